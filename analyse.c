@@ -1,123 +1,120 @@
 #include <stdio.h>
 #include <math.h>
+#include <pthread.h>
 #include "analyse.h"
-#include "colorset.h"
+#include "histogram.h"
+#include "classify.h"
+#include "stats.h"
+#include "workspace.h"
 
 #define fequalzero(a) (fabs(a) < FLT_EPSILON)
 #define colorThresholdMinimumPercentage 0.01
 
-int colorIsBlackOrWhite (const struct NormalColor* color)
+struct Candidate
 {
-	if (color->r > .91 && color->g > .91 && color->b > .91 )
-		return 1; // white
+	uint32_t color;
+	int count;
+};
 
-	if (color->r < .09 && color->g < .09 && color->b < .09 )
-		return 1; // black
-
-	return 0;
+// same order as sortColorsetByWeight: heaviest first, equal weights in colour order
+static int candidateBefore (const struct Candidate* left, const struct Candidate* right)
+{
+	if (left->count != right->count)
+		return left->count > right->count;
+	return left->color < right->color;
 }
 
-int colorIsDark (const struct NormalColor* color)
+static int candidatecomp (const void* left, const void* right)
 {
-	double lum = 0.2126 * color->r + 0.7152 * color->g + 0.0722 * color->b;
-
-	return lum < .5;
+	return candidateBefore(right, left) - candidateBefore(left, right);
 }
 
-int colorIsContrastingWith (const struct NormalColor* background, const struct NormalColor* foreground)
+static struct NormalColor colorOfCandidate (const struct Candidate* candidate)
 {
-	double bLum = 0.2126 * background->r + 0.7152 * background->g + 0.0722 * background->b;
-	double fLum = 0.2126 * foreground->r + 0.7152 * foreground->g + 0.0722 * foreground->b;
-	double contrast = 0.;
+	struct NormalColor color = makeColorFromHash(candidate->color);
 
-	if (bLum > fLum)
-		contrast = (bLum + 0.05) / (fLum + 0.05);
-	else
-		contrast = (fLum + 0.05) / (bLum + 0.05);
-
-	//return contrast > 3.0; //3-4.5 W3C recommends 3:1 ratio, but that filters too many colors
-	return contrast > 1.6;
+	color.weight = candidate->count;
+	return color;
 }
 
-int colorIsDistinctWith (const struct NormalColor* color, const struct NormalColor* compareColor)
+void findEdgeColumn (struct ImageData* data)
 {
-	double threshold = .25; //.15
+	if (data->edgeColumn != NULL)
+		return;
+
+	data->edgeColumn = workspaceEdgeColumn(data->workspace, data->height);
 
-	if (fabs(color->r - compareColor->r) > threshold ||
-		fabs(color->g - compareColor->g) > threshold ||
-		fabs(color->b - compareColor->b) > threshold)
+	// background is clear, keep looking in next column for background color
+	for (int x = 0; x < data->width; ++x)
 	{
-		// check for grays, prevent multiple gray colors
+		const uint32_t* column = data->pixels + x;
+		int opaque = 0;
 
-		if (fabs(color->r - color->g) < .03 && fabs(color->r - color->b) < .03)
+		for (int y = 0; y < data->height; ++y, column += data->width)
 		{
-			if (fabs(compareColor->r - compareColor->g) < .03 && fabs(compareColor->r - compareColor->b) < .03)
-				return 0;
+			data->edgeColumn[y] = *column;
+			if (PIXELALPHA(*column) > 127)
+				opaque = 1;
+		}
+		if (opaque)
+		{
+			if (data->stats != NULL)
+				data->stats->edgeshifts = x;
+			break;
 		}
-
-		return 1;
 	}
-	
-	return 0;
+	if (data->stats != NULL)
+		data->stats->bytesused += data->height * sizeof(uint32_t);
 }
 
 void findEdgeColor (struct ImageData* data, struct NormalColor* edgeColor)
 {
-	int searchColumnX = 0;
-	struct ColorSet* leftEdgeColors = createColorSet();
-	
-	for (int x = 0; x < data->width; ++x)
-	{
-		for (int y = 0; y < data->height; ++y)
-		{
-			struct NormalColor color = *getColorAt(data, x, y);
-			
-			if (x == searchColumnX)
-			{
-				//make sure it's a meaningful color
-				if (color.a > .5)
-					appendColor(leftEdgeColors, &color);
-			}
-		}
-		
-		// background is clear, keep looking in next column for background color
-		if (leftEdgeColors->size == 0 )
-			searchColumnX += 1;
-	}
+	struct Workspace* workspace = data->workspace;
+	struct Histogram* leftEdgeColors = workspace->edgeHistogram;
+	int randomColorsThreshold = (int)((double)data->height * colorThresholdMinimumPercentage);
+	struct Candidate* sortedColors;
+	size_t nsortedColors = 0;
 
-	struct NormalColor *curColor = NULL;
-	struct ColorSet* sortedColors = createColorSet();
+	findEdgeColumn(data);
 
-	int randomColorsThreshold = (int)((double)data->height * colorThresholdMinimumPercentage);
+	clearHistogram(leftEdgeColors);
+	for (int y = 0; y < data->height; ++y)
+	{
+		//make sure it's a meaningful color
+		if (PIXELALPHA(data->edgeColumn[y]) > 127)
+			addToHistogram(leftEdgeColors, data->edgeColumn[y], 1);
+	}
 
-	for (int i = 0; i < leftEdgeColors->size; ++i)
+	sortedColors = reserveBuffer(&workspace->edgeCandidates, &workspace->edgecandidatecapacity, leftEdgeColors->size * sizeof(struct Candidate));
+	for (size_t i = 0; i < leftEdgeColors->size; ++i)
 	{
-		struct NormalColor* curColor = &leftEdgeColors->colors[i];
-		int colorCount = countColorsMatching(leftEdgeColors, curColor);
+		int colorCount = leftEdgeColors->counts[i];
 
 		if (colorCount <= randomColorsThreshold) // prevent using random colors, threshold based on input image height
 			continue;
 
-		appendWeightedColor(sortedColors, curColor, colorCount);
+		sortedColors[nsortedColors].color = leftEdgeColors->colors[i];
+		sortedColors[nsortedColors].count = colorCount;
+		++nsortedColors;
 	}
 
-	sortColorsetByWeight(sortedColors);
+	qsort(sortedColors, nsortedColors, sizeof(struct Candidate), &candidatecomp);
 
-	struct NormalColor* proposedEdgeColor = NULL;
+	const struct Candidate* proposedEdgeColor = NULL;
 
-	if (sortedColors->size > 0)
+	if (nsortedColors > 0)
 	{
-		proposedEdgeColor = &sortedColors->colors[0];
+		proposedEdgeColor = &sortedColors[0];
 
-		if (colorIsBlackOrWhite(proposedEdgeColor)) // want to choose color over black/white so we keep looking
+		if (pixelIsBlackOrWhite(proposedEdgeColor->color)) // want to choose color over black/white so we keep looking
 		{
-			for (int i = 1; i < sortedColors->size; ++i)
+			for (size_t i = 1; i < nsortedColors; ++i)
 			{
-				struct NormalColor *nextProposedColor = &sortedColors->colors[i];
+				const struct Candidate* nextProposedColor = &sortedColors[i];
 
-				if (((double)nextProposedColor->weight / (double)proposedEdgeColor->weight) > .3 ) // make sure the second choice color is 30% as common as the first choice
+				if (10LL * nextProposedColor->count > 3LL * proposedEdgeColor->count) // make sure the second choice color is 30% as common as the first choice
 				{
-					if (!colorIsBlackOrWhite(nextProposedColor))
+					if (!pixelIsBlackOrWhite(nextProposedColor->color))
 					{
 						proposedEdgeColor = nextProposedColor;
 						break;
@@ -132,28 +129,49 @@ void findEdgeColor (struct ImageData* data, struct NormalColor* edgeColor)
 		}
 	}
 
+	// no color is common enough on the edge: transparent black, it was whatever the caller's stack held
 	if (proposedEdgeColor != NULL)
-		*edgeColor = *proposedEdgeColor;
+		*edgeColor = colorOfCandidate(proposedEdgeColor);
+	else
+		*edgeColor = makeColorFromHash(0);
 
-	freeColorSet(leftEdgeColors);
-	freeColorSet(sortedColors);
+	if (data->stats != NULL)
+		data->stats->bytesused += histogramUsedBytes(leftEdgeColors) + nsortedColors * sizeof(struct Candidate);
 }
 
 int countColorsMatchingData (const struct ImageData* data, const struct NormalColor* color)
 {
-	int hash = MAKEINT(color);
-	int hashSize = data->width * data->height;
-	int count = 0;
+	return histogramCount(data->histogram, MAKEINT(color));
+}
+
+static void siftDown (struct Candidate* heap, size_t size, size_t i)
+{
+	struct Candidate moving = heap[i];
 
-	for (int i = 0; i < hashSize; ++i)
+	for (;;)
 	{
-		if (data->pixelHash[i] == hash)
-			++count;
-		else if (count > 0)
+		size_t child = 2 * i + 1;
+
+		if (child >= size)
 			break;
+		if (child + 1 < size && candidateBefore(&heap[child + 1], &heap[child]))
+			++child;
+		if (!candidateBefore(&heap[child], &moving))
+			break;
+		heap[i] = heap[child];
+		i = child;
 	}
+	heap[i] = moving;
+}
 
-	return count;
+// removes the heaviest candidate, heap must not be empty
+static struct Candidate popCandidate (struct Candidate* heap, size_t* size)
+{
+	struct Candidate top = heap[0];
+
+	heap[0] = heap[--*size];
+	siftDown(heap, *size, 0);
+	return top;
 }
 
 void findTextColors (struct ImageData* data, struct NormalColor* primaryColor, struct NormalColor* secondaryColor, struct NormalColor* detailColor, struct NormalColor* backgroundColor)
@@ -162,82 +180,79 @@ void findTextColors (struct ImageData* data, struct NormalColor* primaryColor, s
 	int haveSecondaryColor = 0;
 	int haveDetailColor = 0;
 
-	struct NormalColor curColor;
-	struct ColorSet* sortedColors = createColorSet();
-	int findDarkTextColor = !colorIsDark(backgroundColor);
-
-	int i = 0;
-	int hashSize = data->width * data->height;
-	while (i < hashSize)
-	{
-		int hash = data->pixelHash[i]; 
-		struct NormalColor color = makeColorFromHash(hash);
-
-		if (colorIsDark(&color) == findDarkTextColor)
-		{
-			int count = 1;
+	uint32_t background = MAKEINT(backgroundColor);
+	uint32_t primary = 0;
+	uint32_t secondary = 0;
+	int findDarkTextColor = !pixelIsDark(background);
+	// every text color has to contrast with the background, other colors are never candidates
+	unsigned char wantedClass = (findDarkTextColor ? CLASSDARK : 0) | CLASSCONTRASTING;
+	struct Candidate* candidates = workspaceScratch(data->workspace, data->histogram->size * (sizeof(struct Candidate) + 1));
+	unsigned char* classes = (unsigned char*)(candidates + data->histogram->size);
+	size_t ncandidates = 0;
 
-			while (data->pixelHash[++i] == hash)
-				++count;
+	classifyColors(data->histogram->colors, data->histogram->size, background, classes);
 
-			/*if (count <= 2) // prevent using random colors, threshold should be based on input image size*/
-			/*    continue;*/
-
-			appendWeightedColor(sortedColors, &color, count);
-		}
-		else
+	// histogram colours are distinct already, candidates are taken as they are
+	for (size_t i = 0; i < data->histogram->size; ++i)
+	{
+		if (classes[i] == wantedClass)
 		{
-			++i;
+			candidates[ncandidates].color = data->histogram->colors[i];
+			candidates[ncandidates].count = data->histogram->counts[i];
+			++ncandidates;
 		}
 	}
 
-	sortColorsetByWeight(sortedColors);
+	if (data->stats != NULL)
+	{
+		data->stats->distinctcolors = data->histogram->size;
+		data->stats->candidates = ncandidates;
+		data->stats->bytesused += data->histogram->size * (1 + sizeof(struct Candidate));
+	}
 
-	for (int i = 0; i < sortedColors->size; ++i)
+	// the walk usually stops after a few candidates: heapify in linear time and pop them in weight order
+	// instead of sorting them all
+	for (size_t i = ncandidates / 2; i-- > 0; )
+		siftDown(candidates, ncandidates, i);
+
+	while (ncandidates > 0 && !haveDetailColor)
 	{
-		curColor = sortedColors->colors[i];
+		struct Candidate candidate = popCandidate(candidates, &ncandidates);
 
+		// compared as packed colours, only the chosen ones are converted
 		if (!havePrimaryColor)
 		{
-			if (colorIsContrastingWith(&curColor, backgroundColor))
-			{
-				*primaryColor = curColor;
-				havePrimaryColor = 1;
-			}
+			primary = candidate.color;
+			*primaryColor = colorOfCandidate(&candidate);
+			havePrimaryColor = 1;
 		}
-		else if (!havePrimaryColor)
+		else if (!haveSecondaryColor)
 		{
-			if (!colorIsDistinctWith(primaryColor, &curColor) || !colorIsContrastingWith(&curColor, backgroundColor))
+			if (!pixelsAreDistinct(primary, candidate.color))
 				continue;
-			*secondaryColor = curColor;
+			secondary = candidate.color;
+			*secondaryColor = colorOfCandidate(&candidate);
 			haveSecondaryColor = 1;
 		}
-		else if (!haveDetailColor)
+		else
 		{
-			if (!colorIsDistinctWith(secondaryColor, &curColor) || !colorIsDistinctWith(primaryColor, &curColor) || !colorIsContrastingWith(&curColor, backgroundColor))
+			if (!pixelsAreDistinct(secondary, candidate.color) || !pixelsAreDistinct(primary, candidate.color))
 				continue;
 
-			*detailColor = curColor;
+			*detailColor = colorOfCandidate(&candidate);
 			haveDetailColor = 1;
-			break;
 		}
 	}
-
-	freeColorSet(sortedColors);
 }
 
-void analyseimage (struct ImageData* data)
+static void analysetextcolors (struct ImageData* data, struct NormalColor backgroundColor)
 {
-	/*NSCountedSet *imageColors = nil;*/
-	struct NormalColor backgroundColor;
-	
-	findEdgeColor(data, &backgroundColor);
-
+	long long start;
 	struct NormalColor primaryColor;
 	struct NormalColor secondaryColor;
 	struct NormalColor detailColor;
 
-	int darkBackground = colorIsBlackOrWhite(&backgroundColor);
+	int darkBackground = pixelIsBlackOrWhite(MAKEINT(&backgroundColor));
 
 	if ( darkBackground )
 	{
@@ -264,10 +279,97 @@ void analyseimage (struct ImageData* data)
 		detailColor = blackColor;
 	}
 
-	findTextColors(data, &primaryColor, &secondaryColor, &detailColor, &backgroundColor);
+	if (data->histogram != NULL)
+	{
+		start = STATSSTART(data->stats);
+		findTextColors(data, &primaryColor, &secondaryColor, &detailColor, &backgroundColor);
+		STATSSTOP(data->stats, STATSTEXTCOLORS, start);
+	}
 
 	data->backgroundColor = backgroundColor;
 	data->primaryColor = primaryColor;
 	data->secondaryColor = secondaryColor;
 	data->detailColor = detailColor;
 }
+
+void analyseimage (struct ImageData* data)
+{
+	/*NSCountedSet *imageColors = nil;*/
+	struct NormalColor backgroundColor;
+	long long start = STATSSTART(data->stats);
+	
+	findEdgeColor(data, &backgroundColor);
+	STATSSTOP(data->stats, STATSEDGECOLOR, start);
+
+	analysetextcolors(data, backgroundColor);
+}
+
+struct HistogramBand
+{
+	const uint32_t* pixels;
+	size_t numpixels;
+	struct Histogram* histogram;
+};
+
+static void* fillHistogramBand (void* arg)
+{
+	struct HistogramBand* band = arg;
+
+	fillHistogram(band->histogram, band->pixels, band->numpixels);
+	return NULL;
+}
+
+void analyseimageThreaded (struct ImageData* data, int nthreads)
+{
+	struct NormalColor backgroundColor;
+	size_t rows = data->height / nthreads > 0 ? data->height / nthreads : 1;
+	// findEdgeColor leaves the scratch buffer alone, it holds the bands until they are merged
+	struct HistogramBand* bands = workspaceScratch(data->workspace, nthreads * (sizeof(struct HistogramBand) + sizeof(pthread_t) + sizeof(int)));
+	pthread_t* threads = (pthread_t*)(bands + nthreads);
+	int* started = (int*)(threads + nthreads);
+	int nbands = 0;
+	long long histogramstart = STATSSTART(data->stats);
+	long long start;
+
+	// band 0 goes straight into the image histogram, the others into private ones merged after it in band order,
+	// which inserts colours in the same order a single fill would
+	for (size_t y = 0; y < data->height && nbands < nthreads; y += rows, ++nbands)
+	{
+		struct HistogramBand* band = &bands[nbands];
+		size_t bandrows = nbands == nthreads - 1 || y + rows > data->height ? data->height - y : rows;
+
+		band->pixels = data->pixels + y * data->width;
+		band->numpixels = bandrows * data->width;
+		if (nbands == 0)
+			band->histogram = data->histogram;
+		else
+		{
+			band->histogram = workspaceBandHistogram(data->workspace, nbands - 1, data->histogram->quantBits);
+			started[nbands] = pthread_create(&threads[nbands], NULL, &fillHistogramBand, band) == 0;
+		}
+	}
+
+	// the edge column is read while the bands are counted. it is timed on its own, the histogram
+	// stage takes the time of this thread before and after it, so the stages add up
+	STATSSTOP(data->stats, STATSHISTOGRAM, histogramstart);
+	start = STATSSTART(data->stats);
+	findEdgeColor(data, &backgroundColor);
+	STATSSTOP(data->stats, STATSEDGECOLOR, start);
+
+	histogramstart = STATSSTART(data->stats);
+	fillHistogramBand(&bands[0]);
+	for (int i = 1; i < nbands; ++i)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		else
+			fillHistogramBand(&bands[i]);
+		mergeHistogram(data->histogram, bands[i].histogram);
+	}
+	resolveHistogramMeans(data->histogram);
+	STATSSTOP(data->stats, STATSHISTOGRAM, histogramstart);
+	if (data->stats != NULL)
+		data->stats->bytesused += histogramUsedBytes(data->histogram);
+
+	analysetextcolors(data, backgroundColor);
+}
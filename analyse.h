@@ -2,3 +2,9 @@
 #include "colorart.h"
 
 void analyseimage (struct ImageData* data);
+// fills the empty histogram from pixels on nthreads row bands while the edge color is looked for, then analyses
+void analyseimageThreaded (struct ImageData* data, int nthreads);
+
+void findEdgeColumn (struct ImageData* data);
+void findEdgeColor (struct ImageData* data, struct NormalColor* edgeColor);
+void findTextColors (struct ImageData* data, struct NormalColor* primaryColor, struct NormalColor* secondaryColor, struct NormalColor* detailColor, struct NormalColor* backgroundColor);
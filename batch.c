@@ -0,0 +1,207 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "batch.h"
+
+#define REORDERSLOTSPERWORKER 4
+
+struct BatchResult
+{
+	char* out;
+	size_t outlen;
+	char* err;
+	size_t errlen;
+	int done;
+};
+
+struct Batch
+{
+	struct InputSource* source;
+	int finished;
+	int ordered;
+	BatchProcessFunc process;
+	BatchReleaseFunc release;
+	const void* context;
+
+	// one worker at a time takes the next input, without holding lock: stdin reads, directory scans
+	// and read-ahead waits do not stop the other workers and the printer
+	pthread_mutex_t sourcelock;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int nextjob;
+	int nextprint;
+
+	// reorder buffer, job i waits in slot i % nslots until it is its turn to be printed
+	struct BatchResult* slots;
+	int nslots;
+};
+
+static void writeresult (struct BatchResult* result)
+{
+	fwrite(result->out, 1, result->outlen, stdout);
+	fwrite(result->err, 1, result->errlen, stderr);
+	free(result->out);
+	free(result->err);
+	result->out = NULL;
+	result->err = NULL;
+}
+
+static void* batchworker (void* arg)
+{
+	struct Batch* batch = arg;
+	struct ImageData data;
+
+	memset(&data, 0, sizeof(data));
+
+	for (;;)
+	{
+		int index;
+		int got;
+		struct InputJob job;
+
+		// jobs are numbered in the order they are taken, only the holder of sourcelock takes one
+		pthread_mutex_lock(&batch->sourcelock);
+		pthread_mutex_lock(&batch->lock);
+		// reorder buffer is full, wait for the oldest result to be printed
+		while (batch->ordered && !batch->finished && batch->nextjob >= batch->nextprint + batch->nslots)
+			pthread_cond_wait(&batch->changed, &batch->lock);
+		if (batch->finished)
+		{
+			pthread_mutex_unlock(&batch->lock);
+			pthread_mutex_unlock(&batch->sourcelock);
+			break;
+		}
+		pthread_mutex_unlock(&batch->lock);
+
+		got = nextInput(batch->source, &job);
+
+		pthread_mutex_lock(&batch->lock);
+		index = batch->nextjob;
+		if (got)
+			++batch->nextjob;
+		else
+		{
+			batch->finished = 1;
+			pthread_cond_broadcast(&batch->changed);
+		}
+		pthread_mutex_unlock(&batch->lock);
+		pthread_mutex_unlock(&batch->sourcelock);
+		if (!got)
+			break;
+
+		struct BatchResult result;
+		FILE* out;
+		FILE* err;
+
+		memset(&result, 0, sizeof(result));
+		out = open_memstream(&result.out, &result.outlen);
+		err = open_memstream(&result.err, &result.errlen);
+
+		data.filepath = job.filepath;
+		data.blob = job.blob;
+		data.bloblength = job.bloblength;
+		data.fileblob = job.fileblob;
+		batch->process(&data, batch->context, out, err);
+		data.blob = NULL;
+		freeInputJob(&job);
+
+		fclose(out);
+		fclose(err);
+		result.done = 1;
+
+		pthread_mutex_lock(&batch->lock);
+		if (batch->ordered)
+		{
+			batch->slots[index % batch->nslots] = result;
+			pthread_cond_broadcast(&batch->changed);
+		}
+		else
+		{
+			// written under the lock so lines of different images never interleave
+			writeresult(&result);
+			fflush(stdout);
+		}
+		pthread_mutex_unlock(&batch->lock);
+	}
+
+	if (batch->release != NULL)
+		batch->release(&data);
+	return NULL;
+}
+
+static void printinorder (struct Batch* batch)
+{
+	pthread_mutex_lock(&batch->lock);
+	while (!batch->finished || batch->nextprint < batch->nextjob)
+	{
+		struct BatchResult* slot = &batch->slots[batch->nextprint % batch->nslots];
+
+		if (!slot->done)
+		{
+			pthread_cond_wait(&batch->changed, &batch->lock);
+			continue;
+		}
+
+		struct BatchResult result = *slot;
+
+		slot->done = 0;
+		++batch->nextprint;
+		pthread_cond_broadcast(&batch->changed);
+
+		pthread_mutex_unlock(&batch->lock);
+		writeresult(&result);
+		pthread_mutex_lock(&batch->lock);
+	}
+	pthread_mutex_unlock(&batch->lock);
+}
+
+void runbatch (struct InputSource* source, int nworkers, int ordered, BatchProcessFunc process, BatchReleaseFunc release, const void* context)
+{
+	struct Batch batch;
+	pthread_t* workers;
+	int nstarted = 0;
+
+	if (nworkers < 1)
+		nworkers = 1;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.source = source;
+	batch.ordered = ordered;
+	batch.process = process;
+	batch.release = release;
+	batch.context = context;
+	batch.nslots = nworkers * REORDERSLOTSPERWORKER;
+	if (ordered)
+		batch.slots = calloc(batch.nslots, sizeof(struct BatchResult));
+	pthread_mutex_init(&batch.sourcelock, NULL);
+	pthread_mutex_init(&batch.lock, NULL);
+	pthread_cond_init(&batch.changed, NULL);
+
+	workers = calloc(nworkers, sizeof(pthread_t));
+	for (int i = 0; i < nworkers; ++i)
+	{
+		if (pthread_create(&workers[nstarted], NULL, &batchworker, &batch) == 0)
+			++nstarted;
+		else
+			fprintf(stderr, "could not start worker thread %d\n", i);
+	}
+
+	if (nstarted == 0)
+	{
+		// a single thread finishes its jobs in order, no reordering needed
+		batch.ordered = 0;
+		batchworker(&batch);
+	}
+	else if (ordered)
+		printinorder(&batch);
+
+	for (int i = 0; i < nstarted; ++i)
+		pthread_join(workers[i], NULL);
+
+	fflush(stdout);
+	free(workers);
+	free(batch.slots);
+	pthread_cond_destroy(&batch.changed);
+	pthread_mutex_destroy(&batch.lock);
+	pthread_mutex_destroy(&batch.sourcelock);
+}
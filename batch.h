@@ -0,0 +1,10 @@
+#pragma once
+#include <stdio.h>
+#include "colorart.h"
+#include "input.h"
+
+typedef int (*BatchProcessFunc) (struct ImageData* data, const void* context, FILE* out, FILE* err);
+// called by each worker on its data after its last job
+typedef void (*BatchReleaseFunc) (struct ImageData* data);
+
+void runbatch (struct InputSource* source, int nworkers, int ordered, BatchProcessFunc process, BatchReleaseFunc release, const void* context);
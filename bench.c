@@ -0,0 +1,424 @@
+// microbenchmarks of the analysis stages on synthetic images.
+// prints one JSON object per stage and image: ns per pixel (or per call) and heap allocations of the first,
+// the heaviest and the last (steady state) iteration. ImageMagick is not linked, the "copy" stage is only the
+// copy of ready RGBA into the workspace, not the cost of MagickExportImagePixels
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include "colorart.h"
+#include "analyse.h"
+#include "color.h"
+#include "colorset.h"
+#include "histogram.h"
+#include "classify.h"
+#include "workspace.h"
+#include "libcolorart.h"
+
+// a stage stops after MINBENCHNS of wall time (setup included) or MAXITERATIONS runs
+#define MINBENCHNS 100000000LL
+#define MAXITERATIONS 1000
+
+// allocation counting, the bench is linked with --wrap for these
+void* __real_malloc (size_t size);
+void* __real_calloc (size_t count, size_t size);
+void* __real_realloc (void* ptr, size_t size);
+
+static long allocations;
+
+void* __wrap_malloc (size_t size)
+{
+	++allocations;
+	return __real_malloc(size);
+}
+
+void* __wrap_calloc (size_t count, size_t size)
+{
+	++allocations;
+	return __real_calloc(count, size);
+}
+
+void* __wrap_realloc (void* ptr, size_t size)
+{
+	++allocations;
+	return __real_realloc(ptr, size);
+}
+
+struct BenchImage
+{
+	const char* name;
+	size_t width;
+	size_t height;
+	unsigned char* rgba;
+};
+
+static uint32_t xorshift (uint32_t* state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void makePixel (const char* name, size_t x, size_t y, size_t width, size_t height, uint32_t* random, unsigned char* pixel)
+{
+	static const unsigned char palette[5][3] = { { 20, 40, 160 }, { 250, 240, 10 }, { 240, 240, 240 }, { 10, 200, 90 }, { 200, 50, 60 } };
+
+	pixel[3] = 255;
+	if (strcmp(name, "flat") == 0)
+	{
+		pixel[0] = 200;
+		pixel[1] = 30;
+		pixel[2] = 30;
+	}
+	else if (strcmp(name, "gradient") == 0)
+	{
+		pixel[0] = x * 255 / width;
+		pixel[1] = y * 255 / height;
+		pixel[2] = 128;
+	}
+	else if (strcmp(name, "noisy") == 0)
+	{
+		uint32_t r = xorshift(random);
+
+		pixel[0] = r;
+		pixel[1] = r >> 8;
+		pixel[2] = r >> 16;
+	}
+	else
+	{
+		// few colors in blocks, the margin image has its left tenth transparent
+		const unsigned char* color = palette[x < width / 16 ? 0 : 1 + (x / 16 + y / 16) % 4];
+
+		memcpy(pixel, color, 3);
+		if (strcmp(name, "margin") == 0 && x < width / 10)
+			pixel[3] = 0;
+	}
+}
+
+static void makeImage (struct BenchImage* image, const char* name, size_t width, size_t height)
+{
+	uint32_t random = 2463534242u;
+
+	image->name = name;
+	image->width = width;
+	image->height = height;
+	image->rgba = malloc(width * height * 4);
+	for (size_t y = 0; y < height; ++y)
+		for (size_t x = 0; x < width; ++x)
+			makePixel(name, x, y, width, height, &random, image->rgba + (y * width + x) * 4);
+}
+
+static long long nowns ()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void copyPixels (struct ImageData* data, const struct BenchImage* image)
+{
+	// stands in for fillPixels, without the ImageMagick export
+	data->width = image->width;
+	data->height = image->height;
+	memcpy(data->pixels, image->rgba, image->width * image->height * 4);
+}
+
+static void resetImageData (struct ImageData* data)
+{
+	// as between two images of a batch, the storage stays with the workspace
+	data->edgeColumn = NULL;
+	data->histogram = NULL;
+}
+
+enum Stage
+{
+	STAGECOPY,
+	STAGEHISTOGRAM,
+	STAGECOLORSET,
+	STAGEEDGECOLOR,
+	STAGETEXTCOLORS,
+	STAGEANALYSE,
+	STAGECOUNT,
+};
+
+static const char* stageNames[STAGECOUNT] = { "copy", "histogram", "colorset", "edgecolor", "textcolors", "analyse" };
+
+// runs one iteration of a stage, only the timed part is between start and stop
+static long long runStage (enum Stage stage, struct ImageData* data, const struct BenchImage* image, long* stageallocations)
+{
+	struct NormalColor background, primary, secondary, detail;
+	size_t numpixels = image->width * image->height;
+	long long start, stop;
+	long before;
+
+	copyPixels(data, image);
+	resetImageData(data);
+	if (stage >= STAGEEDGECOLOR)
+	{
+		data->histogram = workspaceHistogram(data->workspace, 0);
+		fillHistogram(data->histogram, data->pixels, numpixels);
+	}
+	if (stage == STAGETEXTCOLORS)
+		findEdgeColor(data, &background);
+
+	before = allocations;
+	start = nowns();
+	switch (stage)
+	{
+	case STAGECOPY:
+		copyPixels(data, image);
+		break;
+	case STAGEHISTOGRAM:
+		data->histogram = workspaceHistogram(data->workspace, 0);
+		fillHistogram(data->histogram, data->pixels, numpixels);
+		break;
+	case STAGECOLORSET:
+		{
+			struct ColorSet* colorset = createColorSet();
+			int found = 0;
+
+			for (size_t i = 0; i < numpixels; ++i)
+			{
+				struct NormalColor color = makeColorFromHash(data->pixels[i]);
+
+				if (!containsColor(colorset, &color))
+					appendColor(colorset, &color);
+				else
+					found += countColorsMatching(colorset, &color) > 0;
+			}
+			freeColorSet(colorset);
+		}
+		break;
+	case STAGEEDGECOLOR:
+		findEdgeColor(data, &background);
+		break;
+	case STAGETEXTCOLORS:
+		primary = secondary = detail = makeColorFromHash(0xffffffff);
+		findTextColors(data, &primary, &secondary, &detail, &background);
+		break;
+	case STAGEANALYSE:
+		analyseimage(data);
+		break;
+	default:
+		break;
+	}
+	stop = nowns();
+	*stageallocations = allocations - before;
+	return stop - start;
+}
+
+static void benchImage (const struct BenchImage* image)
+{
+	struct ImageData data;
+	size_t numpixels = image->width * image->height;
+
+	memset(&data, 0, sizeof(data));
+	data.workspace = createWorkspace();
+	data.pixels = workspacePixels(data.workspace, numpixels);
+
+	for (int stage = 0; stage < STAGECOUNT; ++stage)
+	{
+		long long total = 0;
+		long stageallocations = 0;
+		long firstallocations = 0;
+		long maxallocations = 0;
+		int iterations = 0;
+		long long deadline = nowns() + MINBENCHNS;
+
+		while (iterations < MAXITERATIONS && (iterations == 0 || nowns() < deadline))
+		{
+			total += runStage(stage, &data, image, &stageallocations);
+			// the workspace grows in the first iterations, the last one shows the steady state
+			if (iterations == 0)
+				firstallocations = stageallocations;
+			if (stageallocations > maxallocations)
+				maxallocations = stageallocations;
+			++iterations;
+		}
+
+		printf("{\"stage\": \"%s\", \"image\": \"%s\", \"width\": %zu, \"height\": %zu, \"iterations\": %d, \"ns_per_pixel\": %.3f"
+				", \"allocations_first_image\": %ld, \"allocations_max_image\": %ld, \"allocations_per_image\": %ld}\n",
+				stageNames[stage], image->name, image->width, image->height, iterations,
+				(double)total / iterations / numpixels, firstallocations, maxallocations, stageallocations);
+	}
+
+	resetImageData(&data);
+	freeWorkspace(data.workspace);
+}
+
+static void benchHSV ()
+{
+	const int calls = 1 << 20;
+	uint32_t random = 88172645u;
+	long long start = nowns();
+	double checksum = 0.;
+
+	for (int i = 0; i < calls; ++i)
+	{
+		struct NormalColor color = makeColorFromHash(xorshift(&random));
+
+		makeHSVComp(&color);
+		color.s *= .5;
+		makeRGBComp(&color);
+		checksum += color.r;
+	}
+
+	printf("{\"stage\": \"hsv\", \"calls\": %d, \"ns_per_call\": %.3f, \"checksum\": %.3f}\n",
+			calls, (double)(nowns() - start) / calls, checksum);
+}
+
+// the double predicates the integer ones of classify.c replaced, they have to agree everywhere
+static int referenceIsBlackOrWhite (const struct NormalColor* color)
+{
+	return (color->r > .91 && color->g > .91 && color->b > .91) || (color->r < .09 && color->g < .09 && color->b < .09);
+}
+
+static unsigned char referenceClass (const struct NormalColor* color, double backgroundLuminance)
+{
+	double lum = LUMINANCE(color->r, color->g, color->b);
+	double contrast;
+
+	if (backgroundLuminance > lum)
+		contrast = (backgroundLuminance + 0.05) / (lum + 0.05);
+	else
+		contrast = (lum + 0.05) / (backgroundLuminance + 0.05);
+	return (lum < .5 ? CLASSDARK : 0) | (contrast > 1.6 ? CLASSCONTRASTING : 0);
+}
+
+static int referenceIsDistinct (const struct NormalColor* color, const struct NormalColor* compareColor)
+{
+	if (fabs(color->r - compareColor->r) > .25 || fabs(color->g - compareColor->g) > .25 || fabs(color->b - compareColor->b) > .25)
+		return !(fabs(color->r - color->g) < .03 && fabs(color->r - color->b) < .03
+			&& fabs(compareColor->r - compareColor->g) < .03 && fabs(compareColor->r - compareColor->b) < .03);
+	return 0;
+}
+
+static void checkPredicates ()
+{
+	const uint32_t count = 1 << 24;
+	uint32_t* colors = malloc(count * sizeof(uint32_t));
+	unsigned char* classes = malloc(count);
+	// the last one has colours exactly on its contrast threshold, which the double rounding puts on both sides
+	uint32_t backgrounds[8] = { 0xff000000, 0xffffffff, 0xff808080, 0xff00500f };
+	uint32_t random = 2463534242u;
+	long checked = 0;
+	long mismatches = 0;
+	long long start = nowns();
+
+	// every opaque colour, against a few backgrounds
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		struct NormalColor color = makeColorFromHash(i | 0xff000000);
+
+		colors[i] = i | 0xff000000;
+		mismatches += pixelIsBlackOrWhite(colors[i]) != referenceIsBlackOrWhite(&color);
+		mismatches += pixelIsDark(colors[i]) != ((referenceClass(&color, 0.) & CLASSDARK) != 0);
+		checked += 2;
+	}
+	for (int b = 4; b < sizeof(backgrounds) / sizeof(backgrounds[0]); ++b)
+		backgrounds[b] = xorshift(&random) | 0xff000000;
+	for (int b = 0; b < sizeof(backgrounds) / sizeof(backgrounds[0]); ++b)
+	{
+		struct NormalColor background = makeColorFromHash(backgrounds[b]);
+		double backgroundLuminance = LUMINANCE(background.r, background.g, background.b);
+
+		classifyColors(colors, count, backgrounds[b], classes);
+		for (uint32_t i = 0; i < count; ++i)
+		{
+			struct NormalColor color = makeColorFromHash(colors[i]);
+
+			mismatches += classes[i] != referenceClass(&color, backgroundLuminance);
+		}
+		checked += count;
+	}
+	// distinctness is decided per channel, random pairs and pairs close to the thresholds
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		uint32_t left = xorshift(&random);
+		uint32_t right = i & 1 ? xorshift(&random) : left ^ (xorshift(&random) & 0x7f7f7f);
+		struct NormalColor l = makeColorFromHash(left);
+		struct NormalColor r = makeColorFromHash(right);
+
+		mismatches += pixelsAreDistinct(left, right) != referenceIsDistinct(&l, &r);
+		++checked;
+	}
+
+	printf("{\"stage\": \"predicates\", \"checked\": %ld, \"mismatches\": %ld, \"ms\": %.3f}\n",
+			checked, mismatches, (double)(nowns() - start) / 1e6);
+	free(classes);
+	free(colors);
+}
+
+static int sameResult (const struct ColorArtResult* left, const struct ColorArtResult* right)
+{
+	return memcmp(left, right, sizeof(struct ColorArtResult)) == 0;
+}
+
+// one context through quantised, plain and quantised again images: the histogram it keeps grows while
+// plain, the next quantised image must not use the smaller colour sums of before
+static void checkContextReuse ()
+{
+	struct BenchImage small;
+	struct BenchImage noisy;
+	struct ColorArtContext* context = colorartCreateContext();
+	struct ColorArtContext* fresh = colorartCreateContext();
+	struct ColorArtResult reused;
+	struct ColorArtResult expected;
+	long mismatches = 0;
+
+	makeImage(&small, "noisy", 8, 8);
+	makeImage(&noisy, "noisy", 512, 512);
+
+	colorartSetQuantBits(context, 4);
+	colorartAnalyseRGBA(context, small.rgba, small.width, small.height, small.width * 4, 1., &reused);
+	colorartSetQuantBits(context, 0);
+	colorartAnalyseRGBA(context, noisy.rgba, noisy.width, noisy.height, noisy.width * 4, 1., &reused);
+	colorartAnalyseRGBA(fresh, noisy.rgba, noisy.width, noisy.height, noisy.width * 4, 1., &expected);
+	mismatches += !sameResult(&reused, &expected);
+
+	colorartSetQuantBits(context, 4);
+	colorartSetQuantBits(fresh, 4);
+	colorartAnalyseRGBA(context, noisy.rgba, noisy.width, noisy.height, noisy.width * 4, 1., &reused);
+	colorartAnalyseRGBA(fresh, noisy.rgba, noisy.width, noisy.height, noisy.width * 4, 1., &expected);
+	mismatches += !sameResult(&reused, &expected);
+
+	printf("{\"stage\": \"contextreuse\", \"checked\": 2, \"mismatches\": %ld}\n", mismatches);
+	colorartFreeContext(fresh);
+	colorartFreeContext(context);
+	free(noisy.rgba);
+	free(small.rgba);
+}
+
+int main (int argc, char** argv)
+{
+	static const char* names[] = { "flat", "gradient", "noisy", "fewcolors", "margin" };
+	static const size_t sizes[][2] = { { 256, 256 }, { 1024, 1024 }, { 1920, 1080 } };
+
+	for (int s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s)
+		for (int n = 0; n < sizeof(names) / sizeof(names[0]); ++n)
+		{
+			struct BenchImage image;
+			int selected = argc < 2;
+
+			// optional arguments restrict the run to these image names
+			for (int a = 1; a < argc; ++a)
+				selected |= strcmp(argv[a], names[n]) == 0;
+			if (!selected)
+				continue;
+
+			makeImage(&image, names[n], sizes[s][0], sizes[s][1]);
+			benchImage(&image);
+			free(image.rgba);
+			fflush(stdout);
+		}
+
+	benchHSV();
+	checkPredicates();
+	checkContextReuse();
+	return 0;
+}
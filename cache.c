@@ -0,0 +1,326 @@
+#include "cache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+static const char cacheMagic[8] = "CARTC01\n";
+
+#define FNVOFFSET 14695981039346656037ull
+#define FNVPRIME 1099511628211ull
+#define RECORDALIGN 8
+#define RECORDSIZE(pathlen) ((sizeof(struct CacheRecord) + (pathlen) + RECORDALIGN - 1) / RECORDALIGN * RECORDALIGN)
+
+struct CacheRecord
+{
+	uint64_t pathhash;
+	uint64_t device;
+	uint64_t inode;
+	uint64_t size;
+	int64_t mtimesec;
+	int64_t mtimensec;
+	uint64_t optionshash;
+	uint32_t colors[4]; // background, primary, secondary, detail
+	uint32_t pathlen;
+	uint32_t reserved;
+	// followed by pathlen bytes of path, padded to RECORDALIGN
+};
+
+struct ResultCache
+{
+	char* cachepath;
+	int fd;
+	pthread_mutex_t appendlock;
+
+	const unsigned char* map;
+	size_t mapsize;
+
+	// open addressing table of record offsets into map, 0 marks an empty slot
+	size_t* slots;
+	size_t slotcount;
+};
+
+uint64_t hashBytes (uint64_t hash, const void* bytes, size_t count)
+{
+	const unsigned char* b = bytes;
+
+	if (hash == 0)
+		hash = FNVOFFSET;
+	for (size_t i = 0; i < count; ++i)
+		hash = (hash ^ b[i]) * FNVPRIME;
+	return hash;
+}
+
+static const struct CacheRecord* recordAt (const struct ResultCache* cache, size_t offset)
+{
+	return (const struct CacheRecord*)(cache->map + offset);
+}
+
+static const char* recordPath (const struct CacheRecord* record)
+{
+	return (const char*)(record + 1);
+}
+
+static size_t firstSlot (const struct ResultCache* cache, uint64_t pathhash, uint64_t optionshash)
+{
+	return (size_t)((pathhash ^ (optionshash * FNVPRIME)) % cache->slotcount);
+}
+
+static int sameKey (const struct CacheRecord* left, const struct CacheRecord* right)
+{
+	return left->pathhash == right->pathhash
+		&& left->optionshash == right->optionshash
+		&& left->pathlen == right->pathlen
+		&& memcmp(recordPath(left), recordPath(right), left->pathlen) == 0;
+}
+
+static void indexRecords (struct ResultCache* cache)
+{
+	size_t count = 0;
+
+	for (size_t offset = sizeof(cacheMagic); offset + sizeof(struct CacheRecord) <= cache->mapsize; )
+	{
+		const struct CacheRecord* record = recordAt(cache, offset);
+
+		if (offset + RECORDSIZE(record->pathlen) > cache->mapsize)
+			break;
+		offset += RECORDSIZE(record->pathlen);
+		++count;
+	}
+
+	cache->slotcount = count * 2 + 1;
+	cache->slots = calloc(cache->slotcount, sizeof(size_t));
+
+	for (size_t offset = sizeof(cacheMagic); count > 0; --count)
+	{
+		const struct CacheRecord* record = recordAt(cache, offset);
+		size_t slot = firstSlot(cache, record->pathhash, record->optionshash);
+
+		// a later record for the same key replaces the earlier one
+		while (cache->slots[slot] != 0 && !sameKey(recordAt(cache, cache->slots[slot]), record))
+			slot = (slot + 1) % cache->slotcount;
+		cache->slots[slot] = offset;
+		offset += RECORDSIZE(record->pathlen);
+	}
+}
+
+static int mapCache (struct ResultCache* cache)
+{
+	struct stat st;
+
+	if (fstat(cache->fd, &st) != 0)
+		return 0;
+
+	if (st.st_size == 0)
+	{
+		if (write(cache->fd, cacheMagic, sizeof(cacheMagic)) != sizeof(cacheMagic))
+			return 0;
+		return 1;
+	}
+
+	cache->map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, cache->fd, 0);
+	if (cache->map == MAP_FAILED)
+	{
+		cache->map = NULL;
+		return 0;
+	}
+	cache->mapsize = st.st_size;
+
+	if (cache->mapsize < sizeof(cacheMagic) || memcmp(cache->map, cacheMagic, sizeof(cacheMagic)) != 0)
+	{
+		fprintf(stderr, "'%s' is not a colorart cache, rebuild it with --cache-rebuild\n", cache->cachepath);
+		return 0;
+	}
+
+	indexRecords(cache);
+	return 1;
+}
+
+static void unmapCache (struct ResultCache* cache)
+{
+	if (cache->map != NULL)
+		munmap((void*)cache->map, cache->mapsize);
+	free(cache->slots);
+	cache->map = NULL;
+	cache->mapsize = 0;
+	cache->slots = NULL;
+	cache->slotcount = 0;
+}
+
+struct ResultCache* openResultCache (const char* cachepath, int rebuild)
+{
+	struct ResultCache* cache = calloc(1, sizeof(struct ResultCache));
+
+	cache->cachepath = strdup(cachepath);
+	cache->fd = open(cachepath, O_RDWR | O_CREAT | O_APPEND | (rebuild ? O_TRUNC : 0), 0644);
+	pthread_mutex_init(&cache->appendlock, NULL);
+
+	if (cache->fd < 0 || !mapCache(cache))
+	{
+		if (cache->fd < 0)
+			fprintf(stderr, "could not open cache '%s': %s\n", cachepath, strerror(errno));
+		closeResultCache(cache);
+		return NULL;
+	}
+
+	return cache;
+}
+
+void closeResultCache (struct ResultCache* cache)
+{
+	unmapCache(cache);
+	if (cache->fd >= 0)
+		close(cache->fd);
+	pthread_mutex_destroy(&cache->appendlock);
+	free(cache->cachepath);
+	free(cache);
+}
+
+static void makeRecord (struct CacheRecord* record, const char* filepath, const struct stat* st, uint64_t optionshash)
+{
+	memset(record, 0, sizeof(struct CacheRecord));
+	record->pathlen = strlen(filepath);
+	record->pathhash = hashBytes(0, filepath, record->pathlen);
+	record->device = st->st_dev;
+	record->inode = st->st_ino;
+	record->size = st->st_size;
+	record->mtimesec = st->st_mtim.tv_sec;
+	record->mtimensec = st->st_mtim.tv_nsec;
+	record->optionshash = optionshash;
+}
+
+static int sameFile (const struct CacheRecord* left, const struct CacheRecord* right)
+{
+	return left->device == right->device
+		&& left->inode == right->inode
+		&& left->size == right->size
+		&& left->mtimesec == right->mtimesec
+		&& left->mtimensec == right->mtimensec;
+}
+
+int lookupResult (const struct ResultCache* cache, const char* filepath, const struct stat* st, uint64_t optionshash, struct ImageData* data)
+{
+	struct CacheRecord wanted;
+	char* resolved;
+	int found = 0;
+
+	if (cache->slotcount == 0 || (resolved = realpath(filepath, NULL)) == NULL)
+		return 0;
+
+	makeRecord(&wanted, resolved, st, optionshash);
+
+	for (size_t slot = firstSlot(cache, wanted.pathhash, optionshash); cache->slots[slot] != 0; slot = (slot + 1) % cache->slotcount)
+	{
+		const struct CacheRecord* record = recordAt(cache, cache->slots[slot]);
+
+		if (record->pathhash != wanted.pathhash || record->optionshash != optionshash
+			|| record->pathlen != wanted.pathlen || memcmp(recordPath(record), resolved, wanted.pathlen) != 0)
+			continue;
+
+		if (sameFile(record, &wanted))
+		{
+			data->backgroundColor = makeColorFromHash(record->colors[0]);
+			data->primaryColor = makeColorFromHash(record->colors[1]);
+			data->secondaryColor = makeColorFromHash(record->colors[2]);
+			data->detailColor = makeColorFromHash(record->colors[3]);
+			found = 1;
+		}
+		break;
+	}
+	free(resolved);
+	return found;
+}
+
+static int appendRecord (int fd, const struct CacheRecord* record, const char* filepath)
+{
+	size_t size = RECORDSIZE(record->pathlen);
+	unsigned char* bytes = calloc(1, size);
+	int written;
+
+	memcpy(bytes, record, sizeof(struct CacheRecord));
+	memcpy(bytes + sizeof(struct CacheRecord), filepath, record->pathlen);
+	// a single write keeps the record whole, even with several processes appending
+	written = write(fd, bytes, size) == (ssize_t)size;
+	free(bytes);
+	return written;
+}
+
+void storeResult (struct ResultCache* cache, const char* filepath, const struct stat* st, uint64_t optionshash, const struct ImageData* data)
+{
+	struct CacheRecord record;
+	char* resolved = realpath(filepath, NULL);
+
+	if (resolved == NULL)
+		return;
+	makeRecord(&record, resolved, st, optionshash);
+	// alpha is never printed, and not always set on result colors
+	record.colors[0] = MAKEINT(&data->backgroundColor) & 0xffffff;
+	record.colors[1] = MAKEINT(&data->primaryColor) & 0xffffff;
+	record.colors[2] = MAKEINT(&data->secondaryColor) & 0xffffff;
+	record.colors[3] = MAKEINT(&data->detailColor) & 0xffffff;
+
+	pthread_mutex_lock(&cache->appendlock);
+	if (!appendRecord(cache->fd, &record, resolved))
+		fprintf(stderr, "could not write to cache '%s'\n", cache->cachepath);
+	pthread_mutex_unlock(&cache->appendlock);
+	free(resolved);
+}
+
+int compactResultCache (struct ResultCache* cache)
+{
+	size_t tmplen = strlen(cache->cachepath) + 16;
+	char* tmppath = malloc(tmplen);
+	int fd;
+	int ok = 1;
+
+	snprintf(tmppath, tmplen, "%s.compact", cache->cachepath);
+	fd = open(tmppath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+	if (fd < 0 || write(fd, cacheMagic, sizeof(cacheMagic)) != sizeof(cacheMagic))
+		ok = 0;
+
+	// keep the latest record of each key, as long as its file is still the one it describes
+	for (size_t slot = 0; ok && slot < cache->slotcount; ++slot)
+	{
+		if (cache->slots[slot] == 0)
+			continue;
+
+		const struct CacheRecord* record = recordAt(cache, cache->slots[slot]);
+		char* filepath = strndup(recordPath(record), record->pathlen);
+		struct stat st;
+		struct CacheRecord current;
+
+		// records of caches before paths were resolved are relative to a directory that is not known
+		if (filepath[0] == '/' && stat(filepath, &st) == 0)
+		{
+			makeRecord(&current, filepath, &st, record->optionshash);
+			if (sameFile(record, &current))
+				ok = appendRecord(fd, record, filepath);
+		}
+		free(filepath);
+	}
+
+	if (fd >= 0)
+		close(fd);
+	if (ok && rename(tmppath, cache->cachepath) != 0)
+		ok = 0;
+	if (!ok)
+	{
+		fprintf(stderr, "could not compact cache '%s'\n", cache->cachepath);
+		unlink(tmppath);
+	}
+	free(tmppath);
+
+	if (ok)
+	{
+		// continue on the compacted file
+		unmapCache(cache);
+		close(cache->fd);
+		cache->fd = open(cache->cachepath, O_RDWR | O_APPEND);
+		ok = cache->fd >= 0 && mapCache(cache);
+	}
+	return ok;
+}
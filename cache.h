@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include "colorart.h"
+
+// persistent results, keyed on the resolved path (realpath), device, inode, size, mtime and a hash of the analysis options.
+// the file is an append-only log of records, mmap'd and indexed when opened, later records win
+struct ResultCache;
+
+struct ResultCache* openResultCache (const char* cachepath, int rebuild);
+void closeResultCache (struct ResultCache* cache);
+int compactResultCache (struct ResultCache* cache);
+
+uint64_t hashBytes (uint64_t hash, const void* bytes, size_t count);
+
+// fills the four result colors of data on a hit
+int lookupResult (const struct ResultCache* cache, const char* filepath, const struct stat* st, uint64_t optionshash, struct ImageData* data);
+void storeResult (struct ResultCache* cache, const char* filepath, const struct stat* st, uint64_t optionshash, const struct ImageData* data);
@@ -0,0 +1,211 @@
+#include "classify.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVEX86KERNELS 1
+#endif
+
+#define CHANNEL(c, b) ((double)(((c) >> (b)) & 0xff) / 255.)
+
+// channel thresholds of the double predicates on c / 255., checked for every channel value
+#define BLACKMAX 22 // < .09
+#define WHITEMIN 233 // > .91
+#define DISTINCTMIN 64 // > .25
+#define GRAYMAX 7 // < .03
+
+// luminance .5, and the .05 added to both sides of a contrast ratio
+#define DARKLUMINANCE (LUMINANCESCALE / 2)
+#define CONTRASTOFFSET (LUMINANCESCALE / 20)
+
+// (hi + offset) / (lo + offset) > 1.6 is 5 * (hi + offset) - 8 * (lo + offset) > 0
+#define CONTRASTMARGIN(hi, lo) (5 * ((hi) + CONTRASTOFFSET) - 8 * ((lo) + CONTRASTOFFSET))
+
+#define ABS(x) ((x) < 0 ? -(x) : (x))
+
+double pixelLuminance (uint32_t color)
+{
+	return LUMINANCE(CHANNEL(color, 0), CHANNEL(color, 8), CHANNEL(color, 16));
+}
+
+int pixelIsBlackOrWhite (uint32_t color)
+{
+	uint32_t r = color & 0xff;
+	uint32_t g = (color >> 8) & 0xff;
+	uint32_t b = (color >> 16) & 0xff;
+
+	return (r >= WHITEMIN && g >= WHITEMIN && b >= WHITEMIN) || (r <= BLACKMAX && g <= BLACKMAX && b <= BLACKMAX);
+}
+
+int pixelIsDark (uint32_t color)
+{
+	int32_t lum = PIXELLUMINANCE(color);
+
+	if (lum == DARKLUMINANCE)
+		return pixelLuminance(color) < .5;
+	return lum < DARKLUMINANCE;
+}
+
+static int isGray (uint32_t color)
+{
+	int32_t r = color & 0xff;
+	int32_t g = (color >> 8) & 0xff;
+	int32_t b = (color >> 16) & 0xff;
+
+	return ABS(r - g) <= GRAYMAX && ABS(r - b) <= GRAYMAX;
+}
+
+int pixelsAreDistinct (uint32_t color, uint32_t compareColor)
+{
+	for (int shift = 0; shift < 24; shift += 8)
+	{
+		int32_t delta = (int32_t)((color >> shift) & 0xff) - (int32_t)((compareColor >> shift) & 0xff);
+
+		// prevent multiple gray colors
+		if (ABS(delta) >= DISTINCTMIN)
+			return !(isGray(color) && isGray(compareColor));
+	}
+	return 0;
+}
+
+// the double formula, for colours exactly on a threshold
+static unsigned char classOfLuminance (double lum, double backgroundLuminance)
+{
+	double contrast;
+
+	if (backgroundLuminance > lum)
+		contrast = (backgroundLuminance + 0.05) / (lum + 0.05);
+	else
+		contrast = (lum + 0.05) / (backgroundLuminance + 0.05);
+
+	return (lum < .5 ? CLASSDARK : 0) | (contrast > 1.6 ? CLASSCONTRASTING : 0);
+}
+
+static unsigned char classOfPixel (uint32_t color, int32_t background, double backgroundLuminance)
+{
+	int32_t lum = PIXELLUMINANCE(color);
+	// at most one of them is positive, the one with the brighter colour on top
+	int32_t above = CONTRASTMARGIN(lum, background);
+	int32_t below = CONTRASTMARGIN(background, lum);
+
+	if (lum == DARKLUMINANCE || above == 0 || below == 0)
+		return classOfLuminance(pixelLuminance(color), backgroundLuminance);
+	return (lum < DARKLUMINANCE ? CLASSDARK : 0) | (above > 0 || below > 0 ? CLASSCONTRASTING : 0);
+}
+
+static void classifyColorsScalar (const uint32_t* colors, size_t count, int32_t background, double backgroundLuminance, unsigned char* classes)
+{
+	for (size_t i = 0; i < count; ++i)
+		classes[i] = classOfPixel(colors[i], background, backgroundLuminance);
+}
+
+#ifdef HAVEX86KERNELS
+
+// luminance as in PIXELLUMINANCE: red and green side by side in 16 bits, multiplied by their weights
+// and added in pairs by madd, then blue alone. lanes on a threshold are left to classOfPixel
+
+__attribute__((target("sse2")))
+static __m128i luminanceSSE2 (__m128i pixels)
+{
+	__m128i mask = _mm_set1_epi32(0xff);
+	__m128i rg = _mm_or_si128(_mm_and_si128(pixels, mask), _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(pixels, 8), mask), 16));
+	__m128i b = _mm_and_si128(_mm_srli_epi32(pixels, 16), mask);
+
+	return _mm_add_epi32(_mm_madd_epi16(rg, _mm_set1_epi32(2126 | 7152 << 16)), _mm_madd_epi16(b, _mm_set1_epi32(722)));
+}
+
+__attribute__((target("sse2")))
+static __m128i contrastMarginSSE2 (__m128i hi, __m128i lo)
+{
+	__m128i offset = _mm_set1_epi32(CONTRASTOFFSET);
+
+	hi = _mm_add_epi32(hi, offset);
+	lo = _mm_add_epi32(lo, offset);
+	return _mm_sub_epi32(_mm_add_epi32(_mm_slli_epi32(hi, 2), hi), _mm_slli_epi32(lo, 3));
+}
+
+__attribute__((target("sse2")))
+static void classifyColorsSSE2 (const uint32_t* colors, size_t count, int32_t background, double backgroundLuminance, unsigned char* classes)
+{
+	__m128i backgrounds = _mm_set1_epi32(background);
+	__m128i dark = _mm_set1_epi32(DARKLUMINANCE);
+	__m128i zero = _mm_setzero_si128();
+	size_t i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i lum = luminanceSSE2(_mm_loadu_si128((const __m128i*)(colors + i)));
+		__m128i above = contrastMarginSSE2(lum, backgrounds);
+		__m128i below = contrastMarginSSE2(backgrounds, lum);
+		int isdark = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(lum, dark)));
+		int contrasting = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_cmpgt_epi32(above, zero), _mm_cmpgt_epi32(below, zero))));
+		int tie = _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_cmpeq_epi32(lum, dark),
+				_mm_or_si128(_mm_cmpeq_epi32(above, zero), _mm_cmpeq_epi32(below, zero)))));
+
+		for (int lane = 0; lane < 4; ++lane)
+			classes[i + lane] = (tie >> lane) & 1 ? classOfPixel(colors[i + lane], background, backgroundLuminance)
+				: ((isdark >> lane) & 1 ? CLASSDARK : 0) | ((contrasting >> lane) & 1 ? CLASSCONTRASTING : 0);
+	}
+	classifyColorsScalar(colors + i, count - i, background, backgroundLuminance, classes + i);
+}
+
+__attribute__((target("avx2")))
+static __m256i luminanceAVX2 (__m256i pixels)
+{
+	__m256i mask = _mm256_set1_epi32(0xff);
+	__m256i rg = _mm256_or_si256(_mm256_and_si256(pixels, mask), _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(pixels, 8), mask), 16));
+	__m256i b = _mm256_and_si256(_mm256_srli_epi32(pixels, 16), mask);
+
+	return _mm256_add_epi32(_mm256_madd_epi16(rg, _mm256_set1_epi32(2126 | 7152 << 16)), _mm256_madd_epi16(b, _mm256_set1_epi32(722)));
+}
+
+__attribute__((target("avx2")))
+static __m256i contrastMarginAVX2 (__m256i hi, __m256i lo)
+{
+	__m256i offset = _mm256_set1_epi32(CONTRASTOFFSET);
+
+	hi = _mm256_add_epi32(hi, offset);
+	lo = _mm256_add_epi32(lo, offset);
+	return _mm256_sub_epi32(_mm256_add_epi32(_mm256_slli_epi32(hi, 2), hi), _mm256_slli_epi32(lo, 3));
+}
+
+__attribute__((target("avx2")))
+static void classifyColorsAVX2 (const uint32_t* colors, size_t count, int32_t background, double backgroundLuminance, unsigned char* classes)
+{
+	__m256i backgrounds = _mm256_set1_epi32(background);
+	__m256i dark = _mm256_set1_epi32(DARKLUMINANCE);
+	__m256i zero = _mm256_setzero_si256();
+	size_t i = 0;
+
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i lum = luminanceAVX2(_mm256_loadu_si256((const __m256i*)(colors + i)));
+		__m256i above = contrastMarginAVX2(lum, backgrounds);
+		__m256i below = contrastMarginAVX2(backgrounds, lum);
+		int isdark = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(dark, lum)));
+		int contrasting = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpgt_epi32(above, zero), _mm256_cmpgt_epi32(below, zero))));
+		int tie = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_or_si256(_mm256_cmpeq_epi32(lum, dark),
+				_mm256_or_si256(_mm256_cmpeq_epi32(above, zero), _mm256_cmpeq_epi32(below, zero)))));
+
+		for (int lane = 0; lane < 8; ++lane)
+			classes[i + lane] = (tie >> lane) & 1 ? classOfPixel(colors[i + lane], background, backgroundLuminance)
+				: ((isdark >> lane) & 1 ? CLASSDARK : 0) | ((contrasting >> lane) & 1 ? CLASSCONTRASTING : 0);
+	}
+	classifyColorsScalar(colors + i, count - i, background, backgroundLuminance, classes + i);
+}
+
+#endif
+
+void classifyColors (const uint32_t* colors, size_t count, uint32_t background, unsigned char* classes)
+{
+	int32_t backgroundLum = PIXELLUMINANCE(background);
+	double backgroundLuminance = pixelLuminance(background);
+
+#ifdef HAVEX86KERNELS
+	if (__builtin_cpu_supports("avx2"))
+		classifyColorsAVX2(colors, count, backgroundLum, backgroundLuminance, classes);
+	else if (__builtin_cpu_supports("sse2"))
+		classifyColorsSSE2(colors, count, backgroundLum, backgroundLuminance, classes);
+	else
+#endif
+		classifyColorsScalar(colors, count, backgroundLum, backgroundLuminance, classes);
+}
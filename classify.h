@@ -0,0 +1,28 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define LUMINANCE(r, g, b) (0.2126 * (r) + 0.7152 * (g) + 0.0722 * (b))
+
+// LUMINANCE of the 0..1 channels of a packed colour times LUMINANCESCALE, exact in integers.
+// a threshold on it decides as the double formula does, except exactly on the threshold
+// where the rounding of the double formula decides, and is asked
+#define LUMINANCESCALE (255 * 10000)
+#define PIXELLUMINANCE(c) (2126 * (int32_t)((c) & 0xff) + 7152 * (int32_t)(((c) >> 8) & 0xff) + 722 * (int32_t)(((c) >> 16) & 0xff))
+
+#define CLASSDARK 1
+#define CLASSCONTRASTING 2
+
+// predicates of the analysis on packed RGBA colours, in integers with the results of the double thresholds
+double pixelLuminance (uint32_t color);
+// every channel above .91, or every channel below .09
+int pixelIsBlackOrWhite (uint32_t color);
+// luminance below .5
+int pixelIsDark (uint32_t color);
+// a channel differs by more than .25, and they are not both grays (channels within .03 of red)
+int pixelsAreDistinct (uint32_t color, uint32_t compareColor);
+
+// batch pixelIsDark and contrast ratio with background above 1.6,
+// vectorised with SSE2 or AVX2 when the cpu has them, with identical results
+void classifyColors (const uint32_t* colors, size_t count, uint32_t background, unsigned char* classes);
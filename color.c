@@ -4,6 +4,37 @@
 #define MIN(a, b) ((a) > (b) ? (b) : (a))
 #define MAX(a, b) ((a) < (b) ? (b) : (a))
 
+int colorsEqual (const struct NormalColor* left, const struct NormalColor* right)
+{
+	return left->r == right->r
+		&& left->g == right->g
+		&& left->b == right->b
+		&& left->a == right->a;
+}
+
+int colorsCompare (const struct NormalColor* left, const struct NormalColor* right)
+{
+	int diff = MAKEINT(right) - MAKEINT(left);
+	
+	return diff;
+}
+
+#define NORMALCHAR(c, b) (double)(((c >> b) & 0xff) / 255.)
+
+struct NormalColor makeColorFromHash (int hash)
+{
+	struct NormalColor color;
+
+	color.r = NORMALCHAR(hash, 0);
+	color.g = NORMALCHAR(hash, 8);
+	color.b = NORMALCHAR(hash, 16);
+	color.a = NORMALCHAR(hash, 24);
+	color.h = color.s = color.v = 0.;
+	color.weight = 0;
+
+	return color;
+}
+
 void
 makeHSVComp (struct NormalColor* color)
 {
@@ -2,3 +2,6 @@
 #include "colorart.h"
 
 void ensuresaturation (struct ImageData* data, double maxsat);
+
+void makeHSVComp (struct NormalColor* color);
+void makeRGBComp (struct NormalColor* color);
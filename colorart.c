@@ -1,55 +1,33 @@
 #include <stdio.h>
 #include <string.h>
+#include <math.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
 #include "colorart.h"
 #include "analyse.h"
 #include "color.h"
+#include "batch.h"
+#include "histogram.h"
+#include "cache.h"
+#include "options.h"
+#include "serve.h"
+#include "input.h"
+#include "stats.h"
+#include "workspace.h"
+#include "format.h"
+#include "cover.h"
 #include <MagickWand/MagickWand.h>
 
 #define LIMIT(n, m, v) ((v) > m ? m : ((v) < n ? n : (v)))
-#define NORMCOL(c) ((c) / QuantumRange)
 #define DIM(a) (sizeof(a)/sizeof((a)[0]))
 #define MAXPIXELS (1920*1080)
-
-int colorsEqual (const struct NormalColor* left, const struct NormalColor* right)
-{
-	return left->r == right->r
-		&& left->g == right->g
-		&& left->b == right->b
-		&& left->a == right->a;
-}
-
-int colorsCompare (const struct NormalColor* left, const struct NormalColor* right)
-{
-	int diff = MAKEINT(right) - MAKEINT(left);
-	
-	return diff;
-}
-
-void makeNormalColor (const PixelInfo* pixel, struct NormalColor* color)
-{
-	color->r = NORMCOL(pixel->red);
-	color->g = NORMCOL(pixel->green);
-	color->b = NORMCOL(pixel->blue);
-	color->a = NORMCOL(pixel->alpha);
-}
-
-const struct NormalColor* getColorAt (const struct ImageData* data, int x, int y)
-{
-	static struct NormalColor dummyColor;
-
-	if (x < 0 || data->width <= x || y < 0 || data->height <= y)
-		return &dummyColor;
-	return &data->pixels[y][x];
-}
+#define STREAMBANDROWS 16
+#define READAHEADDEFAULT 8
+#define ANALYSISVERSION 3 // bump when results change, invalidates cached results
 
 #define COLORSTRFMT "#%02x%02x%02x"
-#define COLORSTRLEN 7
-
-void sprintColor(char* str, const struct NormalColor* color)
-{
-	sprintf(str, COLORSTRFMT, CHARCOL(color->r), CHARCOL(color->g), CHARCOL(color->b));
-}
+#define OUTPUTBUFFERSIZE (64 << 10)
 
 void fprintColor(FILE* fd, const struct NormalColor* color)
 {
@@ -61,197 +39,245 @@ void printColor(const struct NormalColor* color)
 	fprintColor(stdout, color);
 }
 
-void debugresult (FILE* fd, const struct ImageData* data)
+void debugresult (struct OutputBuffer* output, const struct ImageData* data)
 {
-	if (fd != NULL)
-	{
-		fprintf(fd, "Image file '%s':\n", data->filepath);
-		fprintf(fd, "background: ");
-		fprintColor(fd, &data->backgroundColor);
-		fprintf(fd, "\nprimary: ");
-		fprintColor(fd, &data->primaryColor);
-		fprintf(fd, "\ndetail: ");
-		fprintColor(fd, &data->detailColor);
-		fprintf(fd, "\nsecondary: ");
-		fprintColor(fd, &data->secondaryColor);
-		fprintf(fd, "\n\n");
-	}
+	appendOutputString(output, "Image file '");
+	appendOutputString(output, data->filepath);
+	appendOutputString(output, "':\nbackground: ");
+	appendOutputColor(output, &data->backgroundColor);
+	appendOutputString(output, "\nprimary: ");
+	appendOutputColor(output, &data->primaryColor);
+	appendOutputString(output, "\ndetail: ");
+	appendOutputColor(output, &data->detailColor);
+	appendOutputString(output, "\nsecondary: ");
+	appendOutputColor(output, &data->secondaryColor);
+	appendOutputString(output, "\n\n");
 }
 
-char* ensureresultlength (char** presult, int neededlen)
+void allocPixels (struct ImageData* data, const struct Options* options)
 {
-	static const int blocksize = 1024;
-	char* result = *presult;
-	int resultlen = result == NULL ? 0 : strlen(result);
-	int alloclen = result == NULL ? 0 : (resultlen / blocksize + 1) * blocksize + 1;
-
-	if (result == NULL || alloclen <= resultlen + neededlen)
-		result = realloc(result, (alloclen + blocksize) * sizeof(char));
-
-	*presult = result;
-	result += resultlen;
-	*result = 0;
-	return result;
+	data->pixels = workspacePixels(data->workspace, data->width * data->height);
+	data->histogram = workspaceHistogram(data->workspace, options->quantbits);
+	if (data->stats != NULL)
+		data->stats->bytesused += data->width * data->height * sizeof(uint32_t);
 }
 
-void appendResultStr (char** presult, const char* str, int nchars)
+int exportPixels (struct ImageData* data, size_t x, size_t y, size_t width, size_t height, uint32_t* pixels, FILE* err)
 {
-	char* result = ensureresultlength(presult, nchars);
+	long long start = STATSSTART(data->stats);
 
-	if (result != NULL)
+	if (MagickExportImagePixels(data->wand, x, y, width, height, "RGBA", CharPixel, pixels) == MagickFalse)
 	{
-		strncpy(result, str, nchars);
-		*(result + nchars) = 0;
+		fprintf(err, "Could not export pixels of '%s'!\n", data->filepath);
+		return 0;
 	}
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	// exported bytes are in RGBA memory order, PACKRGBA wants red in the low byte
+	for (size_t i = 0; i < width * height; ++i)
+		pixels[i] = __builtin_bswap32(pixels[i]);
+#endif
+	STATSSTOP(data->stats, STATSPIXELS, start);
+	return 1;
 }
 
-void appendResultColor (char** presult, const struct NormalColor* color)
+int fillEdgeColumn (struct ImageData* data, FILE* err)
 {
-	char* result = ensureresultlength(presult, COLORSTRLEN);
+	data->edgeColumn = workspaceEdgeColumn(data->workspace, data->height);
+	if (data->stats != NULL)
+		data->stats->bytesused += data->height * sizeof(uint32_t);
 
-	if (result != NULL)
-		sprintColor(result, color);
+	// pull one column at a time, moving right only while the column is fully transparent
+	for (size_t x = 0; x < data->width; ++x)
+	{
+		if (!exportPixels(data, x, 0, 1, data->height, data->edgeColumn, err))
+			return 0;
+		for (size_t y = 0; y < data->height; ++y)
+			if (PIXELALPHA(data->edgeColumn[y]) > 127)
+			{
+				if (data->stats != NULL)
+					data->stats->edgeshifts = x;
+				return 1;
+			}
+	}
+	return 1;
 }
 
-void printresult (const struct ImageData* data, int printfilename, const char* format)
+int streamPixels (struct ImageData* data, const struct Options* options, FILE* err)
 {
-	if (printfilename)
-		printf("%s: ", data->filepath);
+	size_t bandrows = data->height < STREAMBANDROWS ? data->height : STREAMBANDROWS;
+	size_t* firstOpaqueX = workspaceScratch(data->workspace, data->height * sizeof(size_t) + data->width * bandrows * sizeof(uint32_t));
+	uint32_t* band = (uint32_t*)(firstOpaqueX + data->height);
+	size_t edgeX = data->width;
+
+	data->histogram = workspaceHistogram(data->workspace, options->quantbits);
+	data->edgeColumn = workspaceEdgeColumn(data->workspace, data->height);
 
-	if (data->pixels != NULL)
+	for (size_t y0 = 0; y0 < data->height; y0 += bandrows)
 	{
-		char* result = NULL;
+		size_t rows = data->height - y0 < bandrows ? data->height - y0 : bandrows;
 
-		if (format != NULL && *format != 0)
-		{
-			const struct
-			{
-				const char wildcard;
-				const struct NormalColor *color;
-			} validTokens[] =
-			{
-				{ 'b', &data->backgroundColor },
-				{ 'p', &data->primaryColor },
-				{ 's', &data->secondaryColor },
-				{ 'd', &data->detailColor },
-			};
+		if (!exportPixels(data, 0, y0, data->width, rows, band, err))
+			return 0;
 
-			int formatlen = strlen(format);
-			const char* formatleft = format;
+		long long start = STATSSTART(data->stats);
 
-			while (*formatleft != 0)
-			{
-				const char* nextToken = strstr(formatleft, "%");
-				int copynchars = 0;
+		fillHistogram(data->histogram, band, data->width * rows);
+		STATSSTOP(data->stats, STATSHISTOGRAM, start);
 
-				if (nextToken != NULL)
-					copynchars = nextToken - formatleft;
-				else
-					copynchars = strlen(formatleft);
+		// remember the first opaque pixel of each row, the edge column is the leftmost of them
+		for (size_t y = 0; y < rows; ++y)
+		{
+			const uint32_t* row = band + y * data->width;
+			size_t x = 0;
 
-				if (copynchars > 0)
-				{
-					appendResultStr(&result, formatleft, copynchars);
-					formatleft += copynchars;
-				}
-				if (nextToken != NULL)
-				{
-					int tokenFound = 0;
-
-					++formatleft;
-					++nextToken;
-
-					if (*nextToken == '%')
-						appendResultStr(&result, "%", 1);
-					else
-						for (int i = 0; i < DIM(validTokens); ++i)
-						{
-							if (*nextToken == validTokens[i].wildcard)
-							{
-								appendResultColor(&result, validTokens[i].color);
-								++formatleft;
-								tokenFound = 1;
-								break;
-							}
-						}
-				}
+			while (x < data->width && PIXELALPHA(row[x]) <= 127)
+				++x;
+			firstOpaqueX[y0 + y] = x;
+			if (x < data->width)
+			{
+				data->edgeColumn[y0 + y] = row[x];
+				if (x < edgeX)
+					edgeX = x;
 			}
 		}
-		if (result != NULL)
-		{
-			printf("%s", result);
-			free(result);
-		}
 	}
-	else
+
+	// rows whose first opaque pixel is right of the edge column are transparent in it
+	for (size_t y = 0; y < data->height; ++y)
+		if (firstOpaqueX[y] != edgeX)
+			data->edgeColumn[y] = 0;
+
+	if (data->stats != NULL)
 	{
-		printf("no image found.");
+		data->stats->edgeshifts = edgeX < data->width ? edgeX : 0;
+		data->stats->bytesused += (data->width * bandrows + data->height) * sizeof(uint32_t) + data->height * sizeof(size_t)
+			+ histogramUsedBytes(data->histogram);
 	}
-	printf("\n");
+	return 1;
 }
 
-void allocPixels (struct ImageData* data)
+// each seed gets a state of its own: splitmix64 is a bijection that maps no 32-bit seed to 0,
+// the one state xorshift cannot start from
+static uint64_t seedrandom (uint32_t seed)
 {
-	data->pixels = calloc(data->height, sizeof(struct NormalColor*));
-	for (int y = 0; y < data->height; ++y)
-		data->pixels[y] = calloc(data->width, sizeof(struct NormalColor));
-	data->pixelHash = calloc(data->width * data->height, sizeof(int));
-}
+	uint64_t z = seed + 0x9e3779b97f4a7c15ull;
 
-int intcomp (const void* left, const void* right)
-{
-	return *(int*)left < *(int*)right;
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
 }
 
-void sortPixelHash (struct ImageData* data)
+static uint64_t nextrandom (uint64_t* state)
 {
-	int hashSize = data->width * data->height;
+	uint64_t x = *state;
 
-	qsort(data->pixelHash, hashSize, sizeof(int), &intcomp);
+	// xorshift64, enough for picking sample positions
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *state = x;
 }
 
-void fillPixels (struct ImageData* data)
+int samplePixels (struct ImageData* data, const struct Options* options, FILE* err)
 {
-	PixelIterator* it = NewPixelIterator(data->wand);
-	PixelWand** rowpixels;
-	PixelInfo pixel;
-	size_t width;
+	uint32_t* row = workspaceScratch(data->workspace, data->width * sizeof(uint32_t));
+	uint64_t random = seedrandom(options->seed);
+	long long start;
 
-	for (int y = 0; y < data->height; ++y)
-	{
-		rowpixels = PixelGetNextIteratorRow(it, &width);
+	data->histogram = workspaceHistogram(data->workspace, options->quantbits);
+	// the edge column is read in full, the background does not depend on the sample
+	if (!fillEdgeColumn(data, err))
+		return 0;
 
-		if (width != data->width)
+	if (options->sample == SAMPLESTRIDE)
+	{
+		for (size_t y = 0; y < data->height; y += options->samplesize)
 		{
-			fprintf(stderr, "Width changed at row %d!\n", y);
-			break;
+			if (!exportPixels(data, 0, y, data->width, 1, row, err))
+				return 0;
+			start = STATSSTART(data->stats);
+			for (size_t x = 0; x < data->width; x += options->samplesize)
+				addToHistogram(data->histogram, row[x], 1);
+			STATSSTOP(data->stats, STATSHISTOGRAM, start);
 		}
-		for (int x = 0; x < data->width; ++x)
+	}
+	else
+	{
+		// stratified: one random row in each band of rows, one random pixel of that row in each cell of columns,
+		// with about as many bands per row as the image is high per wide
+		double aspect = (double)data->width / (double)data->height;
+		size_t bands = LIMIT(1, data->height, (size_t)round(sqrt((double)options->samplesize / aspect)));
+		size_t cells = LIMIT(1, data->width, (options->samplesize + bands - 1) / bands);
+
+		for (size_t b = 0; b < bands; ++b)
 		{
-			PixelGetMagickColor(rowpixels[x], &pixel);
-			makeNormalColor(&pixel, &data->pixels[y][x]);
-			data->pixelHash[y * data->width + x] = MAKEINT(&data->pixels[y][x]);
+			size_t y0 = b * data->height / bands;
+			size_t y1 = (b + 1) * data->height / bands;
+
+			if (!exportPixels(data, 0, y0 + nextrandom(&random) % (y1 - y0), data->width, 1, row, err))
+				return 0;
+			start = STATSSTART(data->stats);
+			for (size_t c = 0; c < cells; ++c)
+			{
+				size_t x0 = c * data->width / cells;
+				size_t x1 = (c + 1) * data->width / cells;
+
+				addToHistogram(data->histogram, row[x0 + nextrandom(&random) % (x1 - x0)], 1);
+			}
+			STATSSTOP(data->stats, STATSHISTOGRAM, start);
 		}
 	}
 
-	sortPixelHash(data);
+	if (data->stats != NULL)
+		data->stats->bytesused += data->width * sizeof(uint32_t) + histogramUsedBytes(data->histogram);
+	return 1;
+}
+
+int fillPixels (struct ImageData* data, const struct Options* options, FILE* err)
+{
+	size_t numpixels = data->width * data->height;
+
+	if (!exportPixels(data, 0, 0, data->width, data->height, data->pixels, err))
+		return 0;
+	// with threads the histogram is filled by analyseimageThreaded
+	if (options->threads > 1)
+		return 1;
+
+	long long start = STATSSTART(data->stats);
 
-	DestroyPixelIterator(it);
+	fillHistogram(data->histogram, data->pixels, numpixels);
+	STATSSTOP(data->stats, STATSHISTOGRAM, start);
+	if (data->stats != NULL)
+		data->stats->bytesused += histogramUsedBytes(data->histogram);
+	return 1;
 }
 
-void scaledownimage (struct ImageData* data)
+void scaledownimage (struct ImageData* data, const struct Options* options)
 {
 	double numpixels = (double)(data->width * data->height);
-	double scaledownfactor = (double)MAXPIXELS / numpixels;
+	// the budget is an area, each side shrinks by its square root
+	double scaledownfactor = sqrt((double)options->maxpixels / numpixels);
 
 	if (scaledownfactor < 1.)
 	{
 		MagickBooleanType status;
 
-		double width = (int)((double)data->width * scaledownfactor);
-		double height = (int)((double)data->height * scaledownfactor);
+		size_t width = LIMIT(1, data->width, (size_t)((double)data->width * scaledownfactor));
+		size_t height = LIMIT(1, data->height, (size_t)((double)data->height * scaledownfactor));
 
-		status = MagickScaleImage(data->wand, width, height);
+		switch (options->resample)
+		{
+		case RESAMPLESAMPLE:
+			status = MagickSampleImage(data->wand, width, height);
+			break;
+		case RESAMPLERESIZE:
+			status = MagickResizeImage(data->wand, width, height, LanczosFilter);
+			break;
+		default:
+			status = MagickScaleImage(data->wand, width, height);
+			break;
+		}
 
 		if (status == MagickTrue)
 		{
@@ -261,66 +287,411 @@ void scaledownimage (struct ImageData* data)
 	}
 }
 
-int readimage (struct ImageData* data)
+// the storage stays with the workspace for the next image
+void releasePixels (struct ImageData* data)
+{
+	data->pixels = NULL;
+	data->histogram = NULL;
+	data->edgeColumn = NULL;
+}
+
+char* framename (const char* filepath, size_t index)
+{
+	size_t length = strlen(filepath) + 24;
+	char* name = malloc(length);
+
+	snprintf(name, length, "%s[%zu]", filepath, index);
+	return name;
+}
+
+// size, scaling and pixels of the current image of the wand, 0 when its pixels could not be read
+int loadframe (struct ImageData* data, const struct Options* options, FILE* err)
+{
+	long long start;
+
+	data->width = MagickGetImageWidth(data->wand);
+	data->height = MagickGetImageHeight(data->wand);
+
+	if (data->stats != NULL)
+	{
+		data->stats->decodedwidth = data->width;
+		data->stats->decodedheight = data->height;
+	}
+	if (options->maxpixels > 0 && data->width * data->height > options->maxpixels)
+	{
+		start = STATSSTART(data->stats);
+		scaledownimage(data, options);
+		STATSSTOP(data->stats, STATSSCALE, start);
+	}
+	if (data->stats != NULL)
+	{
+		data->stats->width = data->width;
+		data->stats->height = data->height;
+	}
+	if (options->backgroundonly)
+		return fillEdgeColumn(data, err);
+	if (options->sample != SAMPLENONE)
+		return samplePixels(data, options, err);
+	if (options->stream)
+		return streamPixels(data, options, err);
+	allocPixels(data, options);
+	return fillPixels(data, options, err);
+}
+
+void resolvehistogram (struct ImageData* data)
+{
+	if (data->histogram != NULL)
+	{
+		long long start = STATSSTART(data->stats);
+
+		resolveHistogramMeans(data->histogram);
+		STATSSTOP(data->stats, STATSHISTOGRAM, start);
+	}
+}
+
+int mergeframes (struct ImageData* data, const struct Options* options, FILE* err)
+{
+	size_t nframes = MagickGetNumberImages(data->wand);
+	struct Workspace* workspace = NULL;
+	int loaded = 1;
+
+	// frame 0 is loaded and gives the background, the other frames only add their colors.
+	// they share a workspace of their own, the one of data holds frame 0
+	for (size_t i = 1; loaded && i < nframes && MagickSetIteratorIndex(data->wand, i) != MagickFalse; ++i)
+	{
+		struct ImageData frame;
+
+		if (workspace == NULL)
+			workspace = createWorkspace();
+		memset(&frame, 0, sizeof(frame));
+		frame.filepath = data->filepath;
+		frame.wand = data->wand;
+		frame.stats = data->stats;
+		frame.workspace = workspace;
+		loaded = loadframe(&frame, options, err);
+		if (loaded)
+			mergeHistogram(data->histogram, frame.histogram);
+	}
+	if (workspace != NULL)
+		freeWorkspace(workspace);
+	if (data->stats != NULL)
+	{
+		data->stats->width = data->width;
+		data->stats->height = data->height;
+	}
+	return loaded;
+}
+
+int readimage (struct ImageData* data, const struct Options* options, FILE* err)
 {
 	MagickBooleanType status;
+	int loaded = 0;
+	void* mapped = NULL;
+	size_t mappedlength = 0;
+	void* cover = NULL;
+	size_t coverlength = 0;
+	long long start = STATSSTART(data->stats);
+	// the [0] suffix tells ImageMagick to stop decoding after the first frame
+	char* readname = options->frames == FRAMESFIRST ? framename(data->filepath, 0) : NULL;
+
+	// the wand of the previous image was cleared, its options included
+	if (data->wand == NULL)
+		data->wand = NewMagickWand();
+	if (options->maxpixels > 0)
+	{
+		// lets the JPEG decoder scale down while decoding, never below the budget since both sides stay above its root
+		char sizehint[64];
+		size_t side = (size_t)ceil(sqrt((double)options->maxpixels));
+
+		snprintf(sizehint, sizeof(sizehint), "%zux%zu", side, side);
+		MagickSetOption(data->wand, "jpeg:size", sizehint);
+	}
+	// audio files are decoded from their embedded cover, only its bytes are read
+	if (data->blob != NULL)
+		cover = findEmbeddedCover(data->blob, data->bloblength, &coverlength);
+	else if (isAudioFile(data->filepath))
+		cover = readEmbeddedCover(data->filepath, &coverlength);
+	if (cover == NULL && data->blob == NULL && options->usemmap)
+		mapped = mapInputFile(data->filepath, &mappedlength);
+
+	if (cover != NULL)
+	{
+		// no name, the audio file name would mislead the decoder, the picture format is found from its bytes
+		status = MagickReadImageBlob(data->wand, cover, coverlength);
+		free(cover);
+	}
+	else if (data->blob != NULL || mapped != NULL)
+	{
+		// the name still hints the format to ImageMagick
+		MagickSetFilename(data->wand, readname != NULL ? readname : data->filepath);
+		if (mapped != NULL)
+			status = MagickReadImageBlob(data->wand, mapped, mappedlength);
+		else
+			status = MagickReadImageBlob(data->wand, data->blob, data->bloblength);
+	}
+	else
+		status = MagickReadImage(data->wand, readname != NULL ? readname : data->filepath);
 
-	data->wand = NewMagickWand();
-	status = MagickReadImage(data->wand, data->filepath);
+	free(readname);
+	if (mapped != NULL)
+		unmapInputFile(mapped, mappedlength);
+	STATSSTOP(data->stats, STATSDECODE, start);
 	if (status == MagickFalse)
 	{
 		char *description;
 		ExceptionType severity;
 
 		description = MagickGetException(data->wand, &severity);
-		fprintf(stderr, "%s %s %lu %s\n", GetMagickModule(), description);
+		fprintf(err, "%s %s %lu %s\n", GetMagickModule(), description);
 		description = MagickRelinquishMemory(description);
 	}
 	else
 	{
-		data->width = MagickGetImageWidth(data->wand);
-		data->height = MagickGetImageHeight(data->wand);
+		// optimised animations store the rectangles that change from one frame to the next, over a transparent
+		// canvas. the edge and background of a frame are only right on the whole canvas
+		if (options->frames != FRAMESFIRST && MagickGetNumberImages(data->wand) > 1)
+		{
+			MagickWand* coalesced;
 
-		if (data->width * data->height > MAXPIXELS)
-			scaledownimage(data);
-		allocPixels(data);
-		fillPixels(data);
+			start = STATSSTART(data->stats);
+			coalesced = MagickCoalesceImages(data->wand);
+			STATSSTOP(data->stats, STATSDECODE, start);
+			if (coalesced != NULL)
+			{
+				DestroyMagickWand(data->wand);
+				data->wand = coalesced;
+			}
+		}
+		// the wand is left on the last frame read, frame 0 comes first whatever the mode
+		MagickSetFirstIterator(data->wand);
+		loaded = loadframe(data, options, err);
+		if (loaded && options->frames == FRAMESMERGE && data->histogram != NULL)
+			loaded = mergeframes(data, options, err);
+		if (loaded)
+			resolvehistogram(data);
 	}
-	return status != MagickFalse;
+	// an image whose pixels could not be read is skipped like one that could not be decoded
+	return status != MagickFalse && loaded;
+}
+
+void analyseloadedimage (struct ImageData* data, const struct Options* options)
+{
+	if (data->pixels != NULL && options->threads > 1)
+		analyseimageThreaded(data, options->threads);
+	else
+		analyseimage(data);
+	ensuresaturation(data, options->maxsaturation);
 }
 
-void freePixels (struct ImageData* data)
+// each stream gets the lines of the image in a single write
+void printimage (FILE* out, FILE* err, const struct ImageData* data, const struct Options* options, struct OutputBuffer* output)
 {
-	if (data->pixels)
+	formatResult(options->program, data, options->printfilename, output);
+	writeOutput(output, out);
+	if (!options->quiet && (options->format == NULL || *options->format != 0))
 	{
-		for (int y = 0; y < data->height; ++y)
-			free(data->pixels[y]);
-		free(data->pixels);
-		free(data->pixelHash);
+		debugresult(output, data);
+		writeOutput(output, err);
 	}
-	data->pixels = NULL;
 }
 
-struct Options
+struct FrameAnalysis
 {
-	double maxsaturation; // 0.628;
-	const char* format;
-	int printfilename;
-	int quiet;
+	struct ImageData* data;
+	const struct Options* options; // with a single thread per frame
+	size_t nframes;
+	size_t next;
+	struct NormalColor (*colors)[RESULTCOLORCOUNT]; // of each analysed frame
+	char* analysed;
+	FILE* err;
+	pthread_mutex_t lock; // of next, and of the wand the frames are exported from
 };
 
+struct FrameWorker
+{
+	struct FrameAnalysis* analysis;
+	struct Workspace* workspace; // holds one frame at a time
+};
+
+static void* frameworker (void* arg)
+{
+	struct FrameWorker* worker = arg;
+	struct FrameAnalysis* analysis = worker->analysis;
+
+	for (;;)
+	{
+		struct ImageData frame;
+		size_t index;
+		int loaded;
+
+		memset(&frame, 0, sizeof(frame));
+		frame.filepath = analysis->data->filepath;
+		frame.wand = analysis->data->wand;
+		frame.workspace = worker->workspace;
+
+		// the wand has a single iterator, frames are exported one at a time and analysed in parallel
+		pthread_mutex_lock(&analysis->lock);
+		index = analysis->next++;
+		loaded = index < analysis->nframes
+			&& MagickSetIteratorIndex(frame.wand, index) != MagickFalse
+			&& loadframe(&frame, analysis->options, analysis->err);
+		pthread_mutex_unlock(&analysis->lock);
+		if (index >= analysis->nframes)
+			break;
+		// a frame that could not be selected or whose pixels could not be read is left out
+		if (!loaded)
+			continue;
+
+		resolvehistogram(&frame);
+		analyseloadedimage(&frame, analysis->options);
+		analysis->colors[index][RESULTBACKGROUND] = frame.backgroundColor;
+		analysis->colors[index][RESULTPRIMARY] = frame.primaryColor;
+		analysis->colors[index][RESULTSECONDARY] = frame.secondaryColor;
+		analysis->colors[index][RESULTDETAIL] = frame.detailColor;
+		analysis->analysed[index] = 1;
+	}
+	return NULL;
+}
+
+// frame 0 is loaded already. the other frames are analysed on --threads threads, each with a workspace
+// of its own, and all are printed in order as file[n]
+void analyseframes (struct ImageData* data, const struct Options* options, FILE* out, FILE* err)
+{
+	struct FrameAnalysis analysis;
+	struct Options frameoptions = *options;
+	const char* filepath = data->filepath;
+	struct NormalColor firstcolors[RESULTCOLORCOUNT];
+	size_t nworkers;
+	struct FrameWorker* workers;
+	pthread_t* threads;
+	int* started;
+
+	analyseloadedimage(data, options);
+	firstcolors[RESULTBACKGROUND] = data->backgroundColor;
+	firstcolors[RESULTPRIMARY] = data->primaryColor;
+	firstcolors[RESULTSECONDARY] = data->secondaryColor;
+	firstcolors[RESULTDETAIL] = data->detailColor;
+
+	// the threads go to frames, not to the colors of one frame
+	frameoptions.threads = 1;
+	memset(&analysis, 0, sizeof(analysis));
+	analysis.data = data;
+	analysis.options = &frameoptions;
+	analysis.nframes = MagickGetNumberImages(data->wand);
+	analysis.next = 1;
+	analysis.colors = calloc(analysis.nframes, sizeof(*analysis.colors));
+	analysis.analysed = calloc(analysis.nframes, 1);
+	analysis.err = err;
+	pthread_mutex_init(&analysis.lock, NULL);
+
+	nworkers = options->threads > 1 ? options->threads : 1;
+	if (nworkers > analysis.nframes - 1)
+		nworkers = analysis.nframes > 1 ? analysis.nframes - 1 : 1;
+	workers = calloc(nworkers, sizeof(struct FrameWorker));
+	threads = calloc(nworkers, sizeof(pthread_t));
+	started = calloc(nworkers, sizeof(int));
+	// this thread is done with frame 0 and its workspace, it is the first worker
+	workers[0].analysis = &analysis;
+	workers[0].workspace = data->workspace;
+	for (size_t i = 1; i < nworkers; ++i)
+	{
+		workers[i].analysis = &analysis;
+		workers[i].workspace = createWorkspace();
+		started[i] = pthread_create(&threads[i], NULL, &frameworker, &workers[i]) == 0;
+	}
+	frameworker(&workers[0]);
+	for (size_t i = 1; i < nworkers; ++i)
+	{
+		if (started[i])
+			pthread_join(threads[i], NULL);
+		freeWorkspace(workers[i].workspace);
+	}
+
+	for (size_t i = 0; i < analysis.nframes; ++i)
+	{
+		const struct NormalColor* colors = i == 0 ? firstcolors : analysis.colors[i];
+		char* name;
+
+		if (i > 0 && !analysis.analysed[i])
+			continue;
+		data->backgroundColor = colors[RESULTBACKGROUND];
+		data->primaryColor = colors[RESULTPRIMARY];
+		data->secondaryColor = colors[RESULTSECONDARY];
+		data->detailColor = colors[RESULTDETAIL];
+		name = framename(filepath, i);
+		data->filepath = name;
+		printimage(out, err, data, options, data->output);
+		data->filepath = filepath;
+		free(name);
+	}
+
+	free(started);
+	free(threads);
+	free(workers);
+	free(analysis.analysed);
+	free(analysis.colors);
+	pthread_mutex_destroy(&analysis.lock);
+}
+
 void usage (const char* procName)
 {
-	fprintf(stderr, "Usage: %s [-fq] [-s maxsat] [-F formatstr] image [image...]\n"
+	fprintf(stderr, "Usage: %s [-fqur] [-j jobs] [-s maxsat] [-F formatstr] [--stream] [--max-pixels n] [--resample method] [--quant-bits n] [--threads n]\n"
+			"	[--frames first|all|merge] [--ext list] [--read-ahead n] [--output text|json|csv|tsv]\n"
+			"	[--sample stride:n|random:n [--seed n]]\n"
+			"	[--cache file [--cache-rebuild] [--cache-compact] [--cache-bypass]] [--stats[=json]] image [image...]\n"
+			"       %s [options] --serve socket\n"
+			"an image argument of '-' reads stdin\n"
+			"mp3, flac and m4a files are analysed by their embedded cover\n"
 			"-f: print file path\n"
 			"-q: quiet\n"
+			"-j jobs: analyse images on this many threads\n"
+			"-u: with -j, print results as soon as they are ready instead of in input order\n"
+			"-r: walk directory arguments, depth first\n"
 			"-s maxsat: limit output color saturation (0..1)\n"
 			"-F formatstr: format output:\n"
-			"	'%b': background color\n"
-			"	'%p': primary color\n"
-			"	'%s': secondary color\n"
-			"	'%d': detail color\n"
-			, procName);
+			"	'%%b': background color\n"
+			"	'%%p': primary color\n"
+			"	'%%s': secondary color\n"
+			"	'%%d': detail color\n"
+			"--output mode: how results are printed:\n"
+			"	'text': the -F format (default)\n"
+			"	'json': an object per line with the file and the colors of -F, all of them without -F\n"
+			"	'csv', 'tsv': a header line, then the file and the colors of -F per line\n"
+			"--stream: analyse at full resolution, consuming rows as they are exported\n"
+			"--max-pixels n: scale images down to at most n pixels, 0 for no limit (default %d, none with --stream)\n"
+			"--resample method: how images are scaled down:\n"
+			"	'scale': average pixels (default)\n"
+			"	'sample': pick pixels, fastest\n"
+			"	'resize': Lanczos filter, slowest\n"
+			"--quant-bits n: group colors on their top n bits per channel (4..6), each group counts as the mean of its colors\n"
+			"--threads n: count the colors of each image on this many threads (default 1), for large images,\n"
+			"	with --frames all analyse this many frames at once instead\n"
+			"--frames mode: which frames of animations and multi-page images are analysed:\n"
+			"	'first': only the first frame is decoded (default)\n"
+			"	'all': each frame, on --threads threads, printed as file[n]\n"
+			"	'merge': the colors of all frames together, the background of the first\n"
+			"--sample stride:n: build the histogram from every n-th pixel of every n-th row\n"
+			"--sample random:n: build the histogram from about n pixels spread randomly over the image,\n"
+			"	the image is not scaled down unless --max-pixels is given\n"
+			"--seed n: seed of --sample random, results are the same for the same seed (default 0)\n"
+			"--cache file: reuse results of unchanged images from this file, and add new ones to it\n"
+			"--cache-rebuild: start the cache over\n"
+			"--cache-compact: drop outdated entries from the cache, images are optional\n"
+			"--cache-bypass: neither read nor write the cache\n"
+			"--ext list: with -r, only files with one of these comma separated extensions, as in jpg,png\n"
+			"--read-ahead n: read the next n files while analysing, 0 for none (default 0, 8 with -r)\n"
+			"--mmap: map image files into memory instead of reading them\n"
+			"--framed: stdin is a stream of images, each preceded by a line with its length in bytes\n"
+			"--stats[=json]: print stage timings and counters of each image, and a summary of the run, to stderr\n"
+			"--serve socket: answer requests on this unix socket with -j workers, one line each:\n"
+			"	'format formatstr': -F for the next images of the connection, the server's when empty\n"
+			"	'saturation maxsat': -s for the next images of the connection\n"
+			"	'path file': analyse file\n"
+			"	'blob length': analyse the length bytes of image data that follow the line\n"
+			"	path and blob get a result line back, or 'error message'. format and saturation get nothing\n"
+			"	back unless they fail. without -F or format, results are 'background #rrggbb primary #rrggbb\n"
+			"	secondary #rrggbb detail #rrggbb'\n"
+			, procName, procName, MAXPIXELS);
 	exit(1);
 }
 
@@ -328,17 +699,118 @@ void initoptions (struct Options* options)
 {
 	options->maxsaturation = 1.;
 	options->format = NULL;
+	options->output = OUTPUTTEXT;
+	options->program = NULL;
 	options->printfilename = 0;
 	options->quiet = 0;
+	options->jobs = 1;
+	options->unordered = 0;
+	options->backgroundonly = 0;
+	options->stream = 0;
+	options->maxpixels = MAXPIXELS;
+	options->resample = RESAMPLESCALE;
+	options->quantbits = 0;
+	options->threads = 1;
+	options->frames = FRAMESFIRST;
+	options->sample = SAMPLENONE;
+	options->samplesize = 0;
+	options->seed = 0;
+	options->usemmap = 0;
+	options->framed = 0;
+	options->recursive = 0;
+	options->extensions = NULL;
+	options->readahead = 0;
+	options->servepath = NULL;
+	options->cachepath = NULL;
+	options->cacherebuild = 0;
+	options->cachecompact = 0;
+	options->cachebypass = 0;
+	options->cache = NULL;
+	options->stats = STATSOFF;
+	options->statssummary = NULL;
+	options->optionshash = 0;
+}
+
+uint64_t hashoptions (const struct Options* options)
+{
+	// everything that changes the result colors, not how they are printed
+	int version = ANALYSISVERSION;
+	int resample = options->resample;
+	int frames = options->frames;
+	uint64_t hash = hashBytes(0, &version, sizeof(version));
+
+	hash = hashBytes(hash, &options->maxsaturation, sizeof(options->maxsaturation));
+	hash = hashBytes(hash, &options->maxpixels, sizeof(options->maxpixels));
+	hash = hashBytes(hash, &resample, sizeof(resample));
+	hash = hashBytes(hash, &options->quantbits, sizeof(options->quantbits));
+	hash = hashBytes(hash, &frames, sizeof(frames));
+	if (options->sample != SAMPLENONE)
+	{
+		int sample = options->sample;
+
+		hash = hashBytes(hash, &sample, sizeof(sample));
+		hash = hashBytes(hash, &options->samplesize, sizeof(options->samplesize));
+		hash = hashBytes(hash, &options->seed, sizeof(options->seed));
+	}
+	hash = hashBytes(hash, &options->stream, sizeof(options->stream));
+	hash = hashBytes(hash, &options->backgroundonly, sizeof(options->backgroundonly));
+	return hash;
 }
 
 void readoptions (struct Options* options, int argc, char** argv)
 {
+	enum
+	{
+		OPTSTREAM = 256,
+		OPTMAXPIXELS,
+		OPTRESAMPLE,
+		OPTCACHE,
+		OPTCACHEREBUILD,
+		OPTCACHECOMPACT,
+		OPTCACHEBYPASS,
+		OPTSERVE,
+		OPTMMAP,
+		OPTFRAMED,
+		OPTSTATS,
+		OPTQUANTBITS,
+		OPTSAMPLE,
+		OPTSEED,
+		OPTTHREADS,
+		OPTFRAMES,
+		OPTEXT,
+		OPTREADAHEAD,
+		OPTOUTPUT,
+	};
+	static const struct option longoptions[] =
+	{
+		{ "stream", no_argument, NULL, OPTSTREAM },
+		{ "max-pixels", required_argument, NULL, OPTMAXPIXELS },
+		{ "resample", required_argument, NULL, OPTRESAMPLE },
+		{ "cache", required_argument, NULL, OPTCACHE },
+		{ "cache-rebuild", no_argument, NULL, OPTCACHEREBUILD },
+		{ "cache-compact", no_argument, NULL, OPTCACHECOMPACT },
+		{ "cache-bypass", no_argument, NULL, OPTCACHEBYPASS },
+		{ "serve", required_argument, NULL, OPTSERVE },
+		{ "mmap", no_argument, NULL, OPTMMAP },
+		{ "framed", no_argument, NULL, OPTFRAMED },
+		{ "stats", optional_argument, NULL, OPTSTATS },
+		{ "quant-bits", required_argument, NULL, OPTQUANTBITS },
+		{ "sample", required_argument, NULL, OPTSAMPLE },
+		{ "seed", required_argument, NULL, OPTSEED },
+		{ "threads", required_argument, NULL, OPTTHREADS },
+		{ "frames", required_argument, NULL, OPTFRAMES },
+		{ "ext", required_argument, NULL, OPTEXT },
+		{ "read-ahead", required_argument, NULL, OPTREADAHEAD },
+		{ "output", required_argument, NULL, OPTOUTPUT },
+		{ NULL, 0, NULL, 0 },
+	};
 	int error = 0;
+	int maxpixelsset = 0;
+	int readaheadset = 0;
 	int c;
 	opterr = 0;
 
-	while ((c = getopt (argc, argv, "s:fF:q")) != -1)
+	while ((c = getopt_long (argc, argv, "s:fF:qj:ur", longoptions, NULL)) != -1)
 		switch (c)
 		{
 		case 's':
@@ -349,7 +821,7 @@ void readoptions (struct Options* options, int argc, char** argv)
 					options->maxsaturation = maxsaturation;
 				else
 				{
-					fprintf(stderr, "saturation needs to be in the range 0..1");
+					fprintf(stderr, "saturation needs to be in the range 0..1\n");
 					error = 1;
 				}
 			}
@@ -363,6 +835,191 @@ void readoptions (struct Options* options, int argc, char** argv)
 		case 'q':
 			options->quiet = 1;
 			break;
+		case 'j':
+			options->jobs = atoi(optarg);
+			if (options->jobs < 1)
+			{
+				fprintf(stderr, "jobs needs to be at least 1\n");
+				error = 1;
+			}
+			break;
+		case 'u':
+			options->unordered = 1;
+			break;
+		case 'r':
+			options->recursive = 1;
+			break;
+		case OPTSTREAM:
+			options->stream = 1;
+			break;
+		case OPTMAXPIXELS:
+			{
+				char* end;
+				long long maxpixels = strtoll(optarg, &end, 10);
+
+				if (*optarg != 0 && *end == 0 && maxpixels >= 0)
+				{
+					options->maxpixels = maxpixels;
+					maxpixelsset = 1;
+				}
+				else
+				{
+					fprintf(stderr, "max-pixels needs to be a positive number of pixels, or 0\n");
+					error = 1;
+				}
+			}
+			break;
+		case OPTRESAMPLE:
+			if (strcmp(optarg, "scale") == 0)
+				options->resample = RESAMPLESCALE;
+			else if (strcmp(optarg, "sample") == 0)
+				options->resample = RESAMPLESAMPLE;
+			else if (strcmp(optarg, "resize") == 0)
+				options->resample = RESAMPLERESIZE;
+			else
+			{
+				fprintf(stderr, "resample needs to be one of scale, sample or resize\n");
+				error = 1;
+			}
+			break;
+		case OPTQUANTBITS:
+			options->quantbits = atoi(optarg);
+			if (options->quantbits < 4 || options->quantbits > 6)
+			{
+				fprintf(stderr, "quant-bits needs to be in the range 4..6\n");
+				error = 1;
+			}
+			break;
+		case OPTSAMPLE:
+			{
+				// each occurrence is parsed on its own, an earlier --sample does not carry over
+				const char* size = strchr(optarg, ':');
+				char* end = NULL;
+				long long samplesize = 0;
+				int sample = SAMPLENONE;
+
+				if (size != NULL && size - optarg == 6 && strncmp(optarg, "stride", 6) == 0)
+					sample = SAMPLESTRIDE;
+				else if (size != NULL && size - optarg == 6 && strncmp(optarg, "random", 6) == 0)
+					sample = SAMPLERANDOM;
+				if (sample != SAMPLENONE)
+					samplesize = strtoll(size + 1, &end, 10);
+				if (sample == SAMPLENONE || size[1] == 0 || *end != 0 || samplesize < 1)
+				{
+					fprintf(stderr, "sample needs to be stride:n or random:n, with n at least 1\n");
+					options->sample = SAMPLENONE;
+					error = 1;
+				}
+				else
+				{
+					options->sample = sample;
+					options->samplesize = samplesize;
+				}
+			}
+			break;
+		case OPTSEED:
+			{
+				char* end;
+				unsigned long long seed = strtoull(optarg, &end, 10);
+
+				// strtoull takes a minus sign and negates
+				if (*optarg >= '0' && *optarg <= '9' && *end == 0 && seed <= UINT32_MAX)
+					options->seed = seed;
+				else
+				{
+					fprintf(stderr, "seed needs to be a number in the range 0..%u\n", UINT32_MAX);
+					error = 1;
+				}
+			}
+			break;
+		case OPTTHREADS:
+			options->threads = atoi(optarg);
+			if (options->threads < 1)
+			{
+				fprintf(stderr, "threads needs to be at least 1\n");
+				error = 1;
+			}
+			break;
+		case OPTFRAMES:
+			if (strcmp(optarg, "first") == 0)
+				options->frames = FRAMESFIRST;
+			else if (strcmp(optarg, "all") == 0)
+				options->frames = FRAMESALL;
+			else if (strcmp(optarg, "merge") == 0)
+				options->frames = FRAMESMERGE;
+			else
+			{
+				fprintf(stderr, "frames needs to be one of first, all or merge\n");
+				error = 1;
+			}
+			break;
+		case OPTEXT:
+			options->extensions = optarg;
+			break;
+		case OPTREADAHEAD:
+			{
+				char* end;
+				long readahead = strtol(optarg, &end, 10);
+
+				if (*optarg != 0 && *end == 0 && readahead >= 0 && readahead <= 1024)
+				{
+					options->readahead = readahead;
+					readaheadset = 1;
+				}
+				else
+				{
+					fprintf(stderr, "read-ahead needs to be a number of files in the range 0..1024\n");
+					error = 1;
+				}
+			}
+			break;
+		case OPTOUTPUT:
+			if (strcmp(optarg, "text") == 0)
+				options->output = OUTPUTTEXT;
+			else if (strcmp(optarg, "json") == 0)
+				options->output = OUTPUTJSON;
+			else if (strcmp(optarg, "csv") == 0)
+				options->output = OUTPUTCSV;
+			else if (strcmp(optarg, "tsv") == 0)
+				options->output = OUTPUTTSV;
+			else
+			{
+				fprintf(stderr, "output needs to be one of text, json, csv or tsv\n");
+				error = 1;
+			}
+			break;
+		case OPTCACHE:
+			options->cachepath = optarg;
+			break;
+		case OPTCACHEREBUILD:
+			options->cacherebuild = 1;
+			break;
+		case OPTCACHECOMPACT:
+			options->cachecompact = 1;
+			break;
+		case OPTCACHEBYPASS:
+			options->cachebypass = 1;
+			break;
+		case OPTSERVE:
+			options->servepath = optarg;
+			break;
+		case OPTMMAP:
+			options->usemmap = 1;
+			break;
+		case OPTFRAMED:
+			options->framed = 1;
+			break;
+		case OPTSTATS:
+			if (optarg == NULL || strcmp(optarg, "text") == 0)
+				options->stats = STATSTEXT;
+			else if (strcmp(optarg, "json") == 0)
+				options->stats = STATSJSON;
+			else
+			{
+				fprintf(stderr, "stats needs to be text or json\n");
+				error = 1;
+			}
+			break;
 		default:
 			error = 1;
 			break;
@@ -373,53 +1030,181 @@ void readoptions (struct Options* options, int argc, char** argv)
 		usage(argv[0]);
 	}
 
+	// streaming keeps memory bounded and sampling keeps the cost bounded, they only scale down when asked to
+	if ((options->stream || options->sample != SAMPLENONE) && !maxpixelsset)
+		options->maxpixels = 0;
+	// walked directories are where cold reads pile up
+	if (options->recursive && !readaheadset)
+		options->readahead = READAHEADDEFAULT;
+	// merged frames add up into a single histogram, counted on one thread
+	if (options->frames == FRAMESMERGE)
+		options->threads = 1;
+
+	options->program = compileFormat(options->format, options->output);
+	updatederivedoptions(options);
+}
+
+void updatederivedoptions (struct Options* options)
+{
+	// without the debug output, a format that only asks for %b only needs the edge column
+	if (options->quiet || (options->format != NULL && *options->format == 0))
+		options->backgroundonly = !formatUsesTextColors(options->program);
+	else
+		options->backgroundonly = 0;
+
+	options->optionshash = hashoptions(options);
+}
+
+int processimage (struct ImageData* data, const void* context, FILE* out, FILE* err)
+{
+	const struct Options* options = context;
+	struct ImageStats stats;
+	long long start = 0;
+	struct stat st;
+	int cacheable;
+	int found = 0;
+
+	if (data->workspace == NULL)
+		data->workspace = createWorkspace();
+	if (data->output == NULL)
+		data->output = calloc(1, sizeof(struct OutputBuffer));
+	if (options->stats != STATSOFF)
+	{
+		memset(&stats, 0, sizeof(stats));
+		data->stats = &stats;
+		start = statsnow();
+	}
+
+	// the cache holds one result per file
+	cacheable = options->cache != NULL && options->frames != FRAMESALL && (data->blob == NULL || data->fileblob) && stat(data->filepath, &st) == 0;
+	if (cacheable && lookupResult(options->cache, data->filepath, &st, options->optionshash, data))
+	{
+		if (data->stats != NULL)
+			stats.cached = 1;
+		found = 1;
+	}
+	else if (readimage(data, options, err))
+	{
+		if (options->frames == FRAMESALL)
+			analyseframes(data, options, out, err);
+		else
+		{
+			analyseloadedimage(data, options);
+			if (cacheable)
+				storeResult(options->cache, data->filepath, &st, options->optionshash, data);
+		}
+		found = 1;
+	}
+
+	if (found && options->frames != FRAMESALL)
+		printimage(out, err, data, options, data->output);
+	// the wand is kept for the next image, without this one's frames
+	if (data->wand != NULL)
+		ClearMagickWand(data->wand);
+	releasePixels(data);
+
+	if (data->stats != NULL)
+	{
+		STATSSTOP(data->stats, STATSTOTAL, start);
+		printImageStats(err, data->filepath, &stats, options->stats == STATSJSON);
+		if (found && options->statssummary != NULL)
+			addToStatsSummary(options->statssummary, &stats);
+		data->stats = NULL;
+	}
+	return found;
+}
+
+void releaseimagedata (struct ImageData* data)
+{
+	if (data->wand != NULL)
+		data->wand = DestroyMagickWand(data->wand);
+	if (data->workspace != NULL)
+		freeWorkspace(data->workspace);
+	data->workspace = NULL;
+	if (data->output != NULL)
+	{
+		freeOutput(data->output);
+		free(data->output);
+	}
+	data->output = NULL;
 }
 
 int main (int argc, char** argv)
 {
 	struct ImageData data;
 	struct Options options;
+	struct InputSource source;
+	struct InputJob job;
 
-	data.pixels = NULL;
+	memset(&data, 0, sizeof(data));
 
 	initoptions(&options);
 	readoptions(&options, argc, argv);
 
-	if (argc - optind < 1)
+	if (argc - optind < 1 && options.servepath == NULL && !(options.cachepath != NULL && options.cachecompact))
 	{
 		usage(argv[0]);
 	}
 
+	if (options.cachepath != NULL && !options.cachebypass)
+	{
+		options.cache = openResultCache(options.cachepath, options.cacherebuild);
+		if (options.cache != NULL && options.cachecompact)
+			compactResultCache(options.cache);
+	}
+
 	MagickWandGenesis();
 
-	for (int i = optind; i < argc; ++i)
+	// parallelism comes from the workers, keep ImageMagick from oversubscribing the cores
+	if (options.jobs > 1)
+		MagickSetResourceLimit(ThreadResource, 1);
+
+	initInputSource(&source, argv + optind, argc - optind, options.framed, options.recursive, options.extensions, options.readahead);
+	// the same condition as the lookup of processimage
+	if (options.cache != NULL && options.frames != FRAMESALL)
+		skipCachedReadAhead(&source, options.cache, options.optionshash);
+	if (options.stats != STATSOFF && options.servepath == NULL)
+		options.statssummary = createStatsSummary();
+	// results go out in large writes unless someone is watching them
+	if (!isatty(STDOUT_FILENO))
+		setvbuf(stdout, NULL, _IOFBF, OUTPUTBUFFERSIZE);
+	if (options.servepath == NULL)
 	{
-		data.filepath = argv[i];
-		if (readimage(&data))
+		struct OutputBuffer header;
+
+		memset(&header, 0, sizeof(header));
+		formatHeader(options.program, &header);
+		writeOutput(&header, stdout);
+		freeOutput(&header);
+	}
+
+	if (options.servepath != NULL)
+		runserver(options.servepath, &options);
+	else if (options.jobs > 1)
+		runbatch(&source, options.jobs, !options.unordered, &processimage, &releaseimagedata, &options);
+	else
+		while (nextInput(&source, &job))
 		{
-			analyseimage(&data);
-			ensuresaturation(&data, options.maxsaturation);
-			printresult(&data, options.printfilename, options.format);
-			if (!options.quiet && (options.format == NULL || *options.format != 0))
-				debugresult(stderr, &data);
+			data.filepath = job.filepath;
+			data.blob = job.blob;
+			data.bloblength = job.bloblength;
+			data.fileblob = job.fileblob;
+			processimage(&data, &options, stdout, stderr);
+			data.blob = NULL;
+			freeInputJob(&job);
 		}
-		data.wand = DestroyMagickWand(data.wand);
-		freePixels(&data);
+	releaseimagedata(&data);
+
+	if (options.statssummary != NULL)
+	{
+		printStatsSummary(stderr, options.statssummary, options.stats == STATSJSON);
+		freeStatsSummary(options.statssummary);
 	}
+	freeInputSource(&source);
+	freeFormat(options.program);
+	if (options.cache != NULL)
+		closeResultCache(options.cache);
 
 	MagickWandTerminus();
 	return 0;
 }
-
-#define NORMALCHAR(c, b) (double)(((c >> b) & 0xff) / 255.)
-
-struct NormalColor makeColorFromHash (int hash)
-{
-	struct NormalColor color;
-
-	color.r = NORMALCHAR(hash, 0);
-	color.g = NORMALCHAR(hash, 8);
-	color.b = NORMALCHAR(hash, 16);
-
-	return color;
-}
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdlib.h>
+#include <stdint.h>
 
 struct NormalColor
 {
@@ -13,14 +14,22 @@ int colorsEqual (const struct NormalColor* left, const struct NormalColor* right
 int colorsCompare (const struct NormalColor* left, const struct NormalColor* right);
 
 struct _MagickWand;
+struct Histogram;
+struct ImageStats;
+struct Workspace;
+struct OutputBuffer;
 struct ImageData
 {
-	struct NormalColor** pixels;
-	int* pixelHash;
+	uint32_t* pixels; // packed RGBA, see PACKRGBA
+	struct Histogram* histogram;
+	uint32_t* edgeColumn; // first column with an opaque pixel, height pixels
 
 	size_t width;
 	size_t height;
 	const char* filepath;
+	const void* blob; // image bytes to read instead of filepath, when not NULL
+	size_t bloblength;
+	int fileblob; // blob holds the contents of filepath
 
 	struct NormalColor backgroundColor;
 	struct NormalColor primaryColor;
@@ -28,13 +37,16 @@ struct ImageData
 	struct NormalColor detailColor;
 
 	struct _MagickWand *wand;
+	struct ImageStats* stats; // stage timings and counters, not collected when NULL
+	struct Workspace* workspace; // storage the analysis reuses from one image to the next, required
+	struct OutputBuffer* output; // lines of the image before they are written, reused as well
 };
 
-const struct NormalColor* getColorAt (const struct ImageData* data, int x, int y);
-
 void printColor (const struct NormalColor* color);
 
 #define CHARCOL(c) ((unsigned char)((c) * 255.))
-#define MAKEINT(c) ((int)CHARCOL((c)->r) | ((int)CHARCOL((c)->g) << 8) | ((int)CHARCOL((c)->b) << 16) | ((int)CHARCOL((c)->a) << 24))
+#define PACKRGBA(r, g, b, a) ((int)(r) | ((int)(g) << 8) | ((int)(b) << 16) | ((int)(a) << 24))
+#define PIXELALPHA(p) (((p) >> 24) & 0xff)
+#define MAKEINT(c) PACKRGBA(CHARCOL((c)->r), CHARCOL((c)->g), CHARCOL((c)->b), CHARCOL((c)->a))
 
 struct NormalColor makeColorFromHash (int hash);
@@ -3,7 +3,10 @@
 #include <stdio.h>
 #include <assert.h>
 
-static const int chunkSize = 1024;
+static const int initialCapacity = 64;
+static const int initialSlotBits = 7;
+
+#define SLOTINDEX(hash, bits) ((uint32_t)((uint32_t)(hash) * 2654435761u) >> (32 - (bits)))
 
 struct ColorSet* createColorSet ()
 {
@@ -12,94 +15,79 @@ struct ColorSet* createColorSet ()
 	return colorset;
 }
 
-struct ColorSet* createColorSetWithData (const struct ImageData* data)
-{
-	struct ColorSet* colorset = createColorSet();
-
-	for (int x = 0; x < data->width; ++x)
-		for (int y = 0; y < data->height; ++y)
-			appendColor(colorset, getColorAt(data, x, y));
-
-	return colorset;
-}
-
 void freeColorSet (struct ColorSet* colorset)
 {
-	if (colorset->capacity > 0)
-	{
-		free(colorset->colors);
-		free(colorset->pixelHash);
-	}
+	free(colorset->colors);
+	free(colorset->pixelHash);
+	free(colorset->slots);
 	free(colorset);
 }
 
-void appendColor (struct ColorSet* colorset, const struct NormalColor* color)
+static int* findSlot (struct ColorSet* colorset, int hash)
 {
-	if (colorset->size + 1 > colorset->capacity)
-	{
-		colorset->capacity += chunkSize;
-		colorset->colors = realloc(colorset->colors, colorset->capacity * sizeof(struct NormalColor));
-		colorset->pixelHash = realloc(colorset->pixelHash, colorset->capacity * sizeof(int));
-	}
-	colorset->colors[colorset->size] = *color;
-	colorset->pixelHash[colorset->size] = MAKEINT(color);
-	colorset->hashSorted = 0;
-	++colorset->size;
+	int mask = (1 << colorset->slotBits) - 1;
+	int i = SLOTINDEX(hash, colorset->slotBits);
+
+	while (colorset->slots[i] != 0 && colorset->pixelHash[colorset->slots[i] - 1] != hash)
+		i = (i + 1) & mask;
+	return &colorset->slots[i];
 }
 
-void appendWeightedColor (struct ColorSet* colorset, const struct NormalColor* color, int weight)
+static void rebuildSlots (struct ColorSet* colorset)
 {
-	struct NormalColor weightedColor = *color;
+	int slotBits = colorset->slotBits;
 
-	weightedColor.weight = weight;
-	appendColor(colorset, &weightedColor);
-}
+	// keep the table at most half full
+	while ((colorset->size + 1) * 2 > (1 << slotBits))
+		slotBits = slotBits == 0 ? initialSlotBits : slotBits + 1;
 
-static int weightcomp (const void* left, const void* right)
-{
-	return ((struct NormalColor*)left)->weight > ((struct NormalColor*)right)->weight;
+	if (colorset->slots == NULL || slotBits != colorset->slotBits)
+	{
+		free(colorset->slots);
+		colorset->slots = calloc(1 << slotBits, sizeof(int));
+		colorset->slotBits = slotBits;
+	}
+	else
+		memset(colorset->slots, 0, (1 << slotBits) * sizeof(int));
+
+	for (int i = 0; i < colorset->size; ++i)
+		*findSlot(colorset, colorset->pixelHash[i]) = i + 1;
+	colorset->slotsValid = 1;
 }
 
-void sortColorsetByWeight (struct ColorSet* colorset)
+static int* lookupSlot (struct ColorSet* colorset, int hash)
 {
-	qsort(colorset->colors, colorset->size, sizeof(struct NormalColor), &weightcomp);
+	if (!colorset->slotsValid || (colorset->size + 1) * 2 > (1 << colorset->slotBits))
+		rebuildSlots(colorset);
+	return findSlot(colorset, hash);
 }
 
-int intcomp (const void* left, const void* right);
-
-void sortSetPixelHash (struct ColorSet* colorset)
+void appendColor (struct ColorSet* colorset, const struct NormalColor* color)
 {
-	if (!colorset->hashSorted)
+	int hash = MAKEINT(color);
+	int* slot = lookupSlot(colorset, hash);
+
+	if (*slot != 0)
 	{
-		qsort(colorset->pixelHash, colorset->size, sizeof(int), &intcomp);
-		colorset->hashSorted = 1;
+		++colorset->colors[*slot - 1].weight;
+		return;
 	}
-}
 
-int containsColorRecurs(int* pixelHash, int low, int high, int hash) 
-{ 
-   if (high < low) 
-       return -1; 
-
-   int mid = (low + high) / 2;
-   int diff = hash - pixelHash[mid];
-
-   if (diff == 0) 
-       return mid; 
-   if (diff < 0) 
-       return containsColorRecurs(pixelHash, (mid + 1), high, hash); 
-   return containsColorRecurs(pixelHash, low, (mid - 1), hash); 
+	if (colorset->size + 1 > colorset->capacity)
+	{
+		colorset->capacity = colorset->capacity == 0 ? initialCapacity : colorset->capacity * 2;
+		colorset->colors = realloc(colorset->colors, colorset->capacity * sizeof(struct NormalColor));
+		colorset->pixelHash = realloc(colorset->pixelHash, colorset->capacity * sizeof(int));
+	}
+	colorset->colors[colorset->size] = *color;
+	colorset->colors[colorset->size].weight = 1;
+	colorset->pixelHash[colorset->size] = hash;
+	*slot = ++colorset->size;
 }
 
 int containsColor (struct ColorSet* colorset, const struct NormalColor* color)
 {
-	if (colorset->size == 0)
-		return 0;
-
-	int hash = MAKEINT(color);
-
-	sortSetPixelHash(colorset);
-	return containsColorRecurs(colorset->pixelHash, 0, colorset->size, hash) >= 0;
+	return countColorsMatching(colorset, color) > 0;
 }
 
 int countColorsMatching (struct ColorSet* colorset, const struct NormalColor* color)
@@ -107,22 +95,7 @@ int countColorsMatching (struct ColorSet* colorset, const struct NormalColor* co
 	if (colorset->size == 0)
 		return 0;
 
-	int hash = MAKEINT(color);
-
-	sortSetPixelHash(colorset);
+	int slot = *lookupSlot(colorset, MAKEINT(color));
 
-	int matchingIndex = containsColorRecurs(colorset->pixelHash, 0, colorset->size, hash);
-	int count = 0;
-
-	if (matchingIndex >= 0)
-	{
-		count = 1;
-		for (int i = matchingIndex + 1; i < colorset->size && colorset->pixelHash[i] == hash; ++i)
-			++count;
-		for (int i = matchingIndex - 1; i >= 0 && colorset->pixelHash[i] == hash; --i)
-			++count;
-	}
-
-	return count;
+	return slot == 0 ? 0 : colorset->colors[slot - 1].weight;
 }
-
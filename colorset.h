@@ -2,22 +2,25 @@
 
 #include "colorart.h"
 
+// multiset of colours, each distinct colour is stored once in colors[0..size)
+// with its multiplicity in weight. the analysis counts colours in a Histogram,
+// this is only kept as the reference the bench measures it against
 struct ColorSet
 {
 	struct NormalColor* colors;
 	int *pixelHash;
-	int hashSorted;
 	int size;
 	int capacity;
+
+	// open addressing table of index + 1 into colors, 0 marks an empty slot
+	int *slots;
+	int slotBits;
+	int slotsValid;
 };
 
 struct ColorSet* createColorSet ();
-struct ColorSet* createColorSetWithData (const struct ImageData* data);
 void freeColorSet (struct ColorSet* colorset);
 
 void appendColor (struct ColorSet* colorset, const struct NormalColor* color);
-void appendWeightedColor (struct ColorSet* colorset, const struct NormalColor* color, int weight);
 int countColorsMatching (struct ColorSet* colorset, const struct NormalColor* color);
-void sortColorsetByWeight (struct ColorSet* colorset);
-void sortSetPixelHash (struct ColorSet* colorset);
 int containsColor (struct ColorSet* colorset, const struct NormalColor* color);
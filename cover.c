@@ -0,0 +1,480 @@
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "cover.h"
+
+// larger pictures are taken for corrupt sizes
+#define MAXCOVERLENGTH (64u << 20)
+#define FRONTCOVER 3
+
+// a file read with pread, or bytes already in memory
+struct CoverSource
+{
+	int fd;
+	const unsigned char* bytes;
+	uint64_t length;
+};
+
+// the best picture so far, its bytes start at offset of buffer
+struct Cover
+{
+	unsigned char* buffer;
+	size_t offset;
+	size_t length;
+	int type;
+};
+
+static uint32_t be24 (const unsigned char* bytes)
+{
+	return (uint32_t)bytes[0] << 16 | (uint32_t)bytes[1] << 8 | bytes[2];
+}
+
+static uint32_t be32 (const unsigned char* bytes)
+{
+	return (uint32_t)bytes[0] << 24 | be24(bytes + 1);
+}
+
+static uint64_t be64 (const unsigned char* bytes)
+{
+	return (uint64_t)be32(bytes) << 32 | be32(bytes + 4);
+}
+
+// 7 bits per byte, the high bit is never set
+static uint32_t syncsafe (const unsigned char* bytes)
+{
+	return (uint32_t)(bytes[0] & 0x7f) << 21 | (uint32_t)(bytes[1] & 0x7f) << 14 | (uint32_t)(bytes[2] & 0x7f) << 7 | (bytes[3] & 0x7f);
+}
+
+static int readSource (const struct CoverSource* source, uint64_t offset, void* buffer, size_t length)
+{
+	size_t got = 0;
+
+	if (offset > source->length || length > source->length - offset)
+		return 0;
+	if (source->bytes != NULL)
+	{
+		memcpy(buffer, source->bytes + offset, length);
+		return 1;
+	}
+	while (got < length)
+	{
+		ssize_t n = pread(source->fd, (char*)buffer + got, length - got, offset + got);
+
+		if (n <= 0 && !(n < 0 && errno == EINTR))
+			return 0;
+		if (n > 0)
+			got += n;
+	}
+	return 1;
+}
+
+static unsigned char* readBody (const struct CoverSource* source, uint64_t offset, uint64_t length)
+{
+	unsigned char* body;
+
+	if (length == 0 || length > MAXCOVERLENGTH)
+		return NULL;
+	body = malloc(length);
+	if (body != NULL && !readSource(source, offset, body, length))
+	{
+		free(body);
+		body = NULL;
+	}
+	return body;
+}
+
+// takes buffer, returns 1 once a front cover is kept and the search can stop
+static int keepCover (struct Cover* cover, unsigned char* buffer, size_t offset, size_t length, int type)
+{
+	if (cover->buffer == NULL || (type == FRONTCOVER && cover->type != FRONTCOVER))
+	{
+		free(cover->buffer);
+		cover->buffer = buffer;
+		cover->offset = offset;
+		cover->length = length;
+		cover->type = type;
+	}
+	else
+		free(buffer);
+	return cover->type == FRONTCOVER;
+}
+
+static void* finishCover (struct Cover* cover, size_t* length)
+{
+	if (cover->buffer == NULL)
+		return NULL;
+	memmove(cover->buffer, cover->buffer + cover->offset, cover->length);
+	*length = cover->length;
+	return cover->buffer;
+}
+
+// drops the zero byte the writer put after each 0xff
+static size_t resynchronise (unsigned char* bytes, size_t length)
+{
+	size_t out = 0;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		bytes[out++] = bytes[i];
+		if (bytes[i] == 0xff && i + 1 < length && bytes[i + 1] == 0)
+			++i;
+	}
+	return out;
+}
+
+// past the zero ending the text at at, two zero bytes on an even offset in utf-16
+static size_t skipText (const unsigned char* bytes, size_t at, size_t length, int encoding)
+{
+	if (encoding == 1 || encoding == 2)
+	{
+		for (; at + 1 < length; at += 2)
+			if (bytes[at] == 0 && bytes[at + 1] == 0)
+				return at + 2;
+		return length;
+	}
+	for (; at < length; ++at)
+		if (bytes[at] == 0)
+			return at + 1;
+	return length;
+}
+
+// encoding, mime type (a 3 letter format in 2.2), picture type, description, then the picture
+static int parseID3Picture (const unsigned char* bytes, size_t length, int major, size_t* offset, int* type)
+{
+	int encoding;
+	size_t at;
+
+	if (length < 2)
+		return 0;
+	encoding = bytes[0];
+	at = major == 2 ? 4 : skipText(bytes, 1, length, 0);
+	if (at >= length)
+		return 0;
+	*type = bytes[at++];
+	at = skipText(bytes, at, length, encoding);
+	if (at >= length)
+		return 0;
+	*offset = at;
+	return 1;
+}
+
+static int readID3Picture (const struct CoverSource* source, uint64_t at, uint64_t size, int major, int frameflags, struct Cover* cover)
+{
+	unsigned char* body;
+	size_t skip = 0;
+	size_t length;
+	size_t offset;
+	int type;
+
+	// compressed and encrypted frames are skipped, the group byte and data length before the body too
+	if (major == 3)
+	{
+		if (frameflags & 0xc0)
+			return 0;
+		if (frameflags & 0x20)
+			skip += 1;
+	}
+	else if (major == 4)
+	{
+		if (frameflags & 0x0c)
+			return 0;
+		if (frameflags & 0x40)
+			skip += 1;
+		if (frameflags & 0x01)
+			skip += 4;
+	}
+	if (size <= skip)
+		return 0;
+
+	length = size - skip;
+	body = readBody(source, at + skip, length);
+	if (body == NULL)
+		return 0;
+	if (major == 4 && (frameflags & 0x02))
+		length = resynchronise(body, length);
+	if (!parseID3Picture(body, length, major, &offset, &type))
+	{
+		free(body);
+		return 0;
+	}
+	return keepCover(cover, body, offset, length - offset, type);
+}
+
+static void findID3Frames (const struct CoverSource* source, uint64_t at, uint64_t end, int major, int flags, struct Cover* cover)
+{
+	unsigned char header[10];
+	size_t headerlength = major == 2 ? 6 : 10;
+
+	if (flags & 0x40)
+	{
+		// 2.2 has no extended header, the flag meant compression
+		if (major == 2 || !readSource(source, at, header, 4))
+			return;
+		at += major == 3 ? 4 + (uint64_t)be32(header) : syncsafe(header);
+	}
+
+	while (at + headerlength <= end && readSource(source, at, header, headerlength))
+	{
+		uint64_t size;
+		int frameflags = 0;
+		int picture;
+
+		// padding
+		if (header[0] == 0)
+			break;
+		if (major == 2)
+		{
+			size = be24(header + 3);
+			picture = memcmp(header, "PIC", 3) == 0;
+		}
+		else
+		{
+			size = major == 3 ? be32(header + 4) : syncsafe(header + 4);
+			frameflags = header[9];
+			picture = memcmp(header, "APIC", 4) == 0;
+		}
+		at += headerlength;
+		if (size > end - at)
+			break;
+		if (picture && readID3Picture(source, at, size, major, frameflags, cover))
+			return;
+		at += size;
+	}
+}
+
+// 0 when the file does not start with an ID3v2 tag, else tagend is set past it
+static int findID3Cover (const struct CoverSource* source, struct Cover* cover, uint64_t* tagend)
+{
+	unsigned char header[10];
+	int major;
+	int flags;
+	uint64_t end;
+
+	if (!readSource(source, 0, header, 10) || memcmp(header, "ID3", 3) != 0)
+		return 0;
+	major = header[3];
+	flags = header[5];
+	if (major < 2 || major > 4)
+		return 0;
+	end = 10 + (uint64_t)syncsafe(header + 6);
+	*tagend = end + (major == 4 && (flags & 0x10) ? 10 : 0);
+
+	if ((flags & 0x80) && major < 4)
+	{
+		// the whole tag is unsynchronised before 2.4, it is read and parsed from memory
+		unsigned char* tag = readBody(source, 10, end - 10);
+		struct CoverSource memory;
+
+		if (tag == NULL)
+			return 1;
+		memory.fd = -1;
+		memory.bytes = tag;
+		memory.length = resynchronise(tag, end - 10);
+		findID3Frames(&memory, 0, memory.length, major, flags, cover);
+		free(tag);
+	}
+	else
+		findID3Frames(source, 10, end, major, flags, cover);
+	return 1;
+}
+
+// picture type, mime type, description, width, height, depth, colors, then the picture
+static int parseFLACPicture (const unsigned char* bytes, size_t length, size_t* offset, size_t* picturelength, int* type)
+{
+	size_t at = 8;
+	uint32_t n;
+
+	if (length < 8)
+		return 0;
+	*type = be32(bytes);
+	n = be32(bytes + 4);
+	if (n > length - at || length - at - n < 4)
+		return 0;
+	at += n;
+	n = be32(bytes + at);
+	at += 4;
+	if (n > length - at || length - at - n < 20)
+		return 0;
+	at += n + 16;
+	n = be32(bytes + at);
+	at += 4;
+	if (n == 0 || n > length - at)
+		return 0;
+	*offset = at;
+	*picturelength = n;
+	return 1;
+}
+
+static void findFLACCover (const struct CoverSource* source, uint64_t at, struct Cover* cover)
+{
+	unsigned char header[4];
+
+	if (!readSource(source, at, header, 4) || memcmp(header, "fLaC", 4) != 0)
+		return;
+	at += 4;
+
+	// metadata blocks up to the one flagged last, the audio follows
+	while (readSource(source, at, header, 4))
+	{
+		int type = header[0] & 0x7f;
+		uint32_t size = be24(header + 1);
+
+		at += 4;
+		if (type == 6)
+		{
+			unsigned char* body = readBody(source, at, size);
+			size_t offset;
+			size_t length;
+			int picturetype;
+
+			if (body != NULL && parseFLACPicture(body, size, &offset, &length, &picturetype))
+			{
+				if (keepCover(cover, body, offset, length, picturetype))
+					return;
+			}
+			else
+				free(body);
+		}
+		if ((header[0] & 0x80) || type == 127)
+			return;
+		at += size;
+	}
+}
+
+// the child of type among the atoms in [at, end), body and bodyend enclose its contents
+static int findAtom (const struct CoverSource* source, uint64_t at, uint64_t end, const char* type, uint64_t* body, uint64_t* bodyend)
+{
+	unsigned char header[16];
+
+	while (at + 8 <= end && readSource(source, at, header, 8))
+	{
+		uint64_t size = be32(header);
+		uint64_t headerlength = 8;
+
+		// a 64 bit size follows, or the atom runs to the end of its parent
+		if (size == 1)
+		{
+			if (!readSource(source, at + 8, header + 8, 8))
+				return 0;
+			size = be64(header + 8);
+			headerlength = 16;
+		}
+		else if (size == 0)
+			size = end - at;
+		if (size < headerlength || size > end - at)
+			return 0;
+		if (memcmp(header + 4, type, 4) == 0)
+		{
+			*body = at + headerlength;
+			*bodyend = at + size;
+			return 1;
+		}
+		at += size;
+	}
+	return 0;
+}
+
+static void findMP4Cover (const struct CoverSource* source, struct Cover* cover)
+{
+	unsigned char bytes[8];
+	uint64_t body;
+	uint64_t end;
+	uint64_t udta;
+	uint64_t udtaend;
+	uint64_t length;
+	unsigned char* buffer;
+
+	if (!readSource(source, 4, bytes, 4) || memcmp(bytes, "ftyp", 4) != 0)
+		return;
+	if (!findAtom(source, 0, source->length, "moov", &body, &end))
+		return;
+	// itunes keeps the tags in moov.udta.meta, some writers in moov.meta
+	if (!(findAtom(source, body, end, "udta", &udta, &udtaend) && findAtom(source, udta, udtaend, "meta", &body, &end))
+			&& !findAtom(source, body, end, "meta", &body, &end))
+		return;
+	// meta has a version and flags before its children, except in quicktime files
+	if (!readSource(source, body, bytes, 8))
+		return;
+	if (memcmp(bytes + 4, "hdlr", 4) != 0)
+		body += 4;
+	if (!findAtom(source, body, end, "ilst", &body, &end)
+			|| !findAtom(source, body, end, "covr", &body, &end)
+			|| !findAtom(source, body, end, "data", &body, &end))
+		return;
+
+	// the first data atom holds the cover, after its type and locale
+	if (end - body <= 8)
+		return;
+	length = end - body - 8;
+	buffer = readBody(source, body + 8, length);
+	if (buffer != NULL)
+		keepCover(cover, buffer, 0, length, FRONTCOVER);
+}
+
+static void* findCover (const struct CoverSource* source, size_t* length)
+{
+	struct Cover cover;
+	uint64_t tagend = 0;
+
+	memset(&cover, 0, sizeof(cover));
+	if (findID3Cover(source, &cover, &tagend))
+	{
+		// flac files may start with an ID3 tag too
+		if (cover.buffer == NULL)
+			findFLACCover(source, tagend, &cover);
+	}
+	else
+	{
+		findFLACCover(source, 0, &cover);
+		if (cover.buffer == NULL)
+			findMP4Cover(source, &cover);
+	}
+	return finishCover(&cover, length);
+}
+
+int isAudioFile (const char* filepath)
+{
+	static const char* extensions[] = { "mp3", "flac", "m4a", "m4b", "mp4" };
+	const char* dot = strrchr(filepath, '.');
+
+	if (dot == NULL || strchr(dot, '/') != NULL)
+		return 0;
+	for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); ++i)
+		if (strcasecmp(dot + 1, extensions[i]) == 0)
+			return 1;
+	return 0;
+}
+
+void* readEmbeddedCover (const char* filepath, size_t* length)
+{
+	struct CoverSource source;
+	struct stat st;
+	void* cover = NULL;
+
+	source.fd = open(filepath, O_RDONLY | O_CLOEXEC);
+	source.bytes = NULL;
+	if (source.fd < 0)
+		return NULL;
+	if (fstat(source.fd, &st) == 0 && S_ISREG(st.st_mode))
+	{
+		source.length = st.st_size;
+		cover = findCover(&source, length);
+	}
+	close(source.fd);
+	return cover;
+}
+
+void* findEmbeddedCover (const void* blob, size_t bloblength, size_t* length)
+{
+	struct CoverSource source;
+
+	source.fd = -1;
+	source.bytes = blob;
+	source.length = bloblength;
+	return findCover(&source, length);
+}
@@ -0,0 +1,14 @@
+#pragma once
+#include <stddef.h>
+
+// the cover picture embedded in an audio file: the ID3v2 APIC frame of mp3, the METADATA_BLOCK_PICTURE
+// of flac or the covr atom of mp4/m4a. the front cover is preferred, else the first picture.
+// only the tag headers and the picture itself are read, the rest of the file is skipped
+
+// audio files by their extension: mp3, flac, m4a, m4b, mp4
+int isAudioFile (const char* filepath);
+
+// the picture bytes, to be freed, or NULL when the file has none
+void* readEmbeddedCover (const char* filepath, size_t* length);
+// the same on a file already in memory, recognised by its leading bytes
+void* findEmbeddedCover (const void* blob, size_t bloblength, size_t* length);
@@ -0,0 +1,360 @@
+#include <stdlib.h>
+#include <string.h>
+#include "format.h"
+
+static const struct
+{
+	char wildcard;
+	const char* name;
+} resultColors[RESULTCOLORCOUNT] =
+{
+	{ 'b', "background" },
+	{ 'p', "primary" },
+	{ 's', "secondary" },
+	{ 'd', "detail" },
+};
+
+static const struct NormalColor* resultColor (const struct ImageData* data, int color)
+{
+	switch (color)
+	{
+	case RESULTPRIMARY:
+		return &data->primaryColor;
+	case RESULTSECONDARY:
+		return &data->secondaryColor;
+	case RESULTDETAIL:
+		return &data->detailColor;
+	default:
+		return &data->backgroundColor;
+	}
+}
+
+static void addToken (struct FormatProgram* program, int color, size_t offset, size_t length)
+{
+	struct FormatToken* token;
+
+	// consecutive text, as around a dropped %, is one token
+	if (color < 0 && program->ntokens > 0)
+	{
+		token = &program->tokens[program->ntokens - 1];
+		if (token->color < 0 && token->offset + token->length == offset)
+		{
+			token->length += length;
+			return;
+		}
+	}
+	token = &program->tokens[program->ntokens++];
+	token->color = color;
+	token->offset = offset;
+	token->length = length;
+}
+
+static void addColumn (struct FormatProgram* program, int color)
+{
+	for (int i = 0; i < program->ncolumns; ++i)
+		if (program->columns[i] == color)
+			return;
+	program->columns[program->ncolumns++] = color;
+}
+
+struct FormatProgram* compileFormat (const char* format, enum OutputMode mode)
+{
+	struct FormatProgram* program = calloc(1, sizeof(struct FormatProgram));
+	size_t formatlength = format != NULL ? strlen(format) : 0;
+	size_t textlength = 0;
+
+	program->mode = mode;
+	// at most one token per character of the format
+	program->tokens = malloc((formatlength + 1) * sizeof(struct FormatToken));
+	program->text = malloc(formatlength + 1);
+
+	for (size_t i = 0; i < formatlength; ++i)
+	{
+		int color = -1;
+
+		if (format[i] != '%')
+		{
+			program->text[textlength] = format[i];
+			addToken(program, -1, textlength++, 1);
+			continue;
+		}
+		// '%%' is a '%', an unknown or trailing '%' is dropped and what follows it kept
+		if (format[i + 1] == '%')
+		{
+			program->text[textlength] = '%';
+			addToken(program, -1, textlength++, 1);
+			++i;
+			continue;
+		}
+		for (int c = 0; c < RESULTCOLORCOUNT; ++c)
+			if (format[i + 1] == resultColors[c].wildcard)
+				color = c;
+		if (color >= 0)
+		{
+			addToken(program, color, 0, 0);
+			addColumn(program, color);
+			++i;
+		}
+	}
+	program->text[textlength] = 0;
+
+	if (mode != OUTPUTTEXT && program->ncolumns == 0)
+		for (int c = 0; c < RESULTCOLORCOUNT; ++c)
+			addColumn(program, c);
+	return program;
+}
+
+void freeFormat (struct FormatProgram* program)
+{
+	if (program != NULL)
+	{
+		free(program->tokens);
+		free(program->text);
+		free(program);
+	}
+}
+
+int formatUsesTextColors (const struct FormatProgram* program)
+{
+	for (int i = 0; i < program->ncolumns; ++i)
+		if (program->columns[i] != RESULTBACKGROUND)
+			return 1;
+	return 0;
+}
+
+static char* reserveOutput (struct OutputBuffer* output, size_t length)
+{
+	if (output->length + length > output->capacity)
+	{
+		size_t capacity = output->capacity == 0 ? 1024 : output->capacity * 2;
+
+		while (capacity < output->length + length)
+			capacity *= 2;
+		output->bytes = realloc(output->bytes, capacity);
+		output->capacity = capacity;
+	}
+	return output->bytes + output->length;
+}
+
+void appendOutput (struct OutputBuffer* output, const char* bytes, size_t length)
+{
+	memcpy(reserveOutput(output, length), bytes, length);
+	output->length += length;
+}
+
+void appendOutputString (struct OutputBuffer* output, const char* str)
+{
+	appendOutput(output, str, strlen(str));
+}
+
+void appendOutputColor (struct OutputBuffer* output, const struct NormalColor* color)
+{
+	static const char digits[] = "0123456789abcdef";
+	unsigned char channels[3] = { CHARCOL(color->r), CHARCOL(color->g), CHARCOL(color->b) };
+	char* str = reserveOutput(output, 7);
+
+	// #rrggbb
+	str[0] = '#';
+	for (int i = 0; i < 3; ++i)
+	{
+		str[1 + i * 2] = digits[channels[i] >> 4];
+		str[2 + i * 2] = digits[channels[i] & 0xf];
+	}
+	output->length += 7;
+}
+
+void writeOutput (struct OutputBuffer* output, FILE* fd)
+{
+	if (output->length > 0)
+		fwrite(output->bytes, 1, output->length, fd);
+	output->length = 0;
+}
+
+void freeOutput (struct OutputBuffer* output)
+{
+	free(output->bytes);
+	output->bytes = NULL;
+	output->length = 0;
+	output->capacity = 0;
+}
+
+size_t utf8SequenceLength (const char* str)
+{
+	const unsigned char* s = (const unsigned char*)str;
+	unsigned char low = 0x80;
+	unsigned char high = 0xbf;
+	size_t length;
+
+	if (s[0] < 0x80)
+		return 1;
+	if (s[0] >= 0xc2 && s[0] <= 0xdf)
+		length = 2;
+	else if (s[0] >= 0xe0 && s[0] <= 0xef)
+		length = 3;
+	else if (s[0] >= 0xf0 && s[0] <= 0xf4)
+		length = 4;
+	else
+		return 0;
+	// no overlong forms, surrogates or code points past U+10FFFF
+	if (s[0] == 0xe0)
+		low = 0xa0;
+	else if (s[0] == 0xed)
+		high = 0x9f;
+	else if (s[0] == 0xf0)
+		low = 0x90;
+	else if (s[0] == 0xf4)
+		high = 0x8f;
+	if (s[1] < low || s[1] > high)
+		return 0;
+	for (size_t i = 2; i < length; ++i)
+		if (s[i] < 0x80 || s[i] > 0xbf)
+			return 0;
+	return length;
+}
+
+static void appendJSONString (struct OutputBuffer* output, const char* str)
+{
+	static const char digits[] = "0123456789abcdef";
+
+	appendOutput(output, "\"", 1);
+	for (; *str != 0; ++str)
+	{
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+		{
+			char escaped[2] = { '\\', c };
+
+			appendOutput(output, escaped, 2);
+		}
+		else if (c < 0x20)
+		{
+			char escaped[6] = { '\\', 'u', '0', '0', digits[c >> 4], digits[c & 0xf] };
+
+			appendOutput(output, escaped, 6);
+		}
+		else
+		{
+			size_t length = utf8SequenceLength(str);
+
+			// file names are bytes, the ones that are not UTF-8 are replaced
+			if (length == 0)
+				appendOutputString(output, "\\ufffd");
+			else
+			{
+				appendOutput(output, str, length);
+				str += length - 1;
+			}
+		}
+	}
+	appendOutput(output, "\"", 1);
+}
+
+static void appendCSVField (struct OutputBuffer* output, const char* str)
+{
+	// quoted only when it has to be, quotes doubled
+	if (strpbrk(str, ",\"\r\n") == NULL)
+	{
+		appendOutputString(output, str);
+		return;
+	}
+	appendOutput(output, "\"", 1);
+	for (; *str != 0; ++str)
+	{
+		if (*str == '"')
+			appendOutput(output, "\"", 1);
+		appendOutput(output, str, 1);
+	}
+	appendOutput(output, "\"", 1);
+}
+
+static void appendTSVField (struct OutputBuffer* output, const char* str)
+{
+	// tabs and line breaks cannot be quoted in tsv, they are escaped as \t, \n and \r
+	for (; *str != 0; ++str)
+	{
+		switch (*str)
+		{
+		case '\t':
+			appendOutput(output, "\\t", 2);
+			break;
+		case '\n':
+			appendOutput(output, "\\n", 2);
+			break;
+		case '\r':
+			appendOutput(output, "\\r", 2);
+			break;
+		case '\\':
+			appendOutput(output, "\\\\", 2);
+			break;
+		default:
+			appendOutput(output, str, 1);
+			break;
+		}
+	}
+}
+
+void formatHeader (const struct FormatProgram* program, struct OutputBuffer* output)
+{
+	const char* separator = program->mode == OUTPUTCSV ? "," : "\t";
+
+	if (program->mode != OUTPUTCSV && program->mode != OUTPUTTSV)
+		return;
+	appendOutputString(output, "file");
+	for (int i = 0; i < program->ncolumns; ++i)
+	{
+		appendOutputString(output, separator);
+		appendOutputString(output, resultColors[program->columns[i]].name);
+	}
+	appendOutput(output, "\n", 1);
+}
+
+void formatResult (const struct FormatProgram* program, const struct ImageData* data, int printfilename, struct OutputBuffer* output)
+{
+	switch (program->mode)
+	{
+	case OUTPUTJSON:
+		appendOutputString(output, "{\"file\": ");
+		appendJSONString(output, data->filepath);
+		for (int i = 0; i < program->ncolumns; ++i)
+		{
+			appendOutputString(output, ", \"");
+			appendOutputString(output, resultColors[program->columns[i]].name);
+			appendOutputString(output, "\": \"");
+			appendOutputColor(output, resultColor(data, program->columns[i]));
+			appendOutput(output, "\"", 1);
+		}
+		appendOutputString(output, "}\n");
+		break;
+	case OUTPUTCSV:
+	case OUTPUTTSV:
+		if (program->mode == OUTPUTCSV)
+			appendCSVField(output, data->filepath);
+		else
+			appendTSVField(output, data->filepath);
+		for (int i = 0; i < program->ncolumns; ++i)
+		{
+			appendOutput(output, program->mode == OUTPUTCSV ? "," : "\t", 1);
+			appendOutputColor(output, resultColor(data, program->columns[i]));
+		}
+		appendOutput(output, "\n", 1);
+		break;
+	default:
+		if (printfilename)
+		{
+			appendOutputString(output, data->filepath);
+			appendOutput(output, ": ", 2);
+		}
+		for (size_t i = 0; i < program->ntokens; ++i)
+		{
+			const struct FormatToken* token = &program->tokens[i];
+
+			if (token->color < 0)
+				appendOutput(output, program->text + token->offset, token->length);
+			else
+				appendOutputColor(output, resultColor(data, token->color));
+		}
+		appendOutput(output, "\n", 1);
+		break;
+	}
+}
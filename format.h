@@ -0,0 +1,65 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include "colorart.h"
+
+// bytes of the lines of one image, kept by a worker and reused for the next
+struct OutputBuffer
+{
+	char* bytes;
+	size_t length;
+	size_t capacity;
+};
+
+enum OutputMode
+{
+	OUTPUTTEXT, // the -F format
+	OUTPUTJSON, // one object per line
+	OUTPUTCSV,
+	OUTPUTTSV,
+};
+
+enum ResultColor
+{
+	RESULTBACKGROUND,
+	RESULTPRIMARY,
+	RESULTSECONDARY,
+	RESULTDETAIL,
+	RESULTCOLORCOUNT,
+};
+
+struct FormatToken
+{
+	int color; // a ResultColor, -1 for literal text
+	size_t offset; // of the literal text in FormatProgram.text
+	size_t length;
+};
+
+// a -F format parsed once into literal text and color tokens. json, csv and tsv print the colors
+// it uses as columns after the file path, all four when there is no format
+struct FormatProgram
+{
+	enum OutputMode mode;
+	struct FormatToken* tokens;
+	size_t ntokens;
+	char* text; // the format without its % escapes
+	int columns[RESULTCOLORCOUNT]; // distinct colors in the order of the format
+	int ncolumns;
+};
+
+struct FormatProgram* compileFormat (const char* format, enum OutputMode mode);
+void freeFormat (struct FormatProgram* program);
+int formatUsesTextColors (const struct FormatProgram* program);
+
+void appendOutput (struct OutputBuffer* output, const char* bytes, size_t length);
+void appendOutputString (struct OutputBuffer* output, const char* str);
+void appendOutputColor (struct OutputBuffer* output, const struct NormalColor* color);
+// bytes of the valid UTF-8 sequence str starts with, 0 when it is not one
+size_t utf8SequenceLength (const char* str);
+// in one write, the buffer is empty after
+void writeOutput (struct OutputBuffer* output, FILE* fd);
+void freeOutput (struct OutputBuffer* output);
+
+// column names line of csv and tsv, nothing for the other modes
+void formatHeader (const struct FormatProgram* program, struct OutputBuffer* output);
+void formatResult (const struct FormatProgram* program, const struct ImageData* data, int printfilename, struct OutputBuffer* output);
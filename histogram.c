@@ -0,0 +1,188 @@
+#include "histogram.h"
+#include "colorart.h"
+#include <stdlib.h>
+#include <string.h>
+
+static const int initialSlotBits = 10;
+
+#define SLOTINDEX(color, bits) ((uint32_t)((color) * 2654435761u) >> (32 - (bits)))
+
+struct Histogram* createHistogram ()
+{
+	struct Histogram* histogram = calloc(1, sizeof(struct Histogram));
+
+	return histogram;
+}
+
+void freeHistogram (struct Histogram* histogram)
+{
+	free(histogram->colors);
+	free(histogram->counts);
+	free(histogram->slots);
+	free(histogram->sums);
+	free(histogram);
+}
+
+void clearHistogram (struct Histogram* histogram)
+{
+	if (histogram->slots != NULL)
+		memset(histogram->slots, 0, ((size_t)1 << histogram->slotBits) * sizeof(int));
+	histogram->size = 0;
+}
+
+static void growSums (struct Histogram* histogram)
+{
+	histogram->sums = realloc(histogram->sums, histogram->capacity * 4 * sizeof(uint64_t));
+	histogram->sumsCapacity = histogram->capacity;
+}
+
+void setHistogramQuantBits (struct Histogram* histogram, int bits)
+{
+	uint32_t channelMask;
+
+	// bits outside 1..7 keep every colour as it is
+	histogram->quantBits = bits > 0 && bits < 8 ? bits : 0;
+	channelMask = (0xffu << (8 - histogram->quantBits)) & 0xff;
+	histogram->quantMask = channelMask | channelMask << 8 | channelMask << 16 | channelMask << 24;
+	// a reused histogram may have grown while it was not quantised
+	if (histogram->quantBits != 0 && histogram->sumsCapacity < histogram->capacity)
+		growSums(histogram);
+}
+
+static int* findSlot (const struct Histogram* histogram, uint32_t color)
+{
+	size_t mask = ((size_t)1 << histogram->slotBits) - 1;
+	size_t i = SLOTINDEX(color, histogram->slotBits);
+
+	while (histogram->slots[i] != 0 && histogram->colors[histogram->slots[i] - 1] != color)
+		i = (i + 1) & mask;
+	return &histogram->slots[i];
+}
+
+static void rehashSlots (struct Histogram* histogram)
+{
+	memset(histogram->slots, 0, ((size_t)1 << histogram->slotBits) * sizeof(int));
+	for (size_t i = 0; i < histogram->size; ++i)
+		*findSlot(histogram, histogram->colors[i]) = i + 1;
+}
+
+static void growSlots (struct Histogram* histogram)
+{
+	histogram->slotBits = histogram->slotBits == 0 ? initialSlotBits : histogram->slotBits + 1;
+	free(histogram->slots);
+	histogram->slots = calloc((size_t)1 << histogram->slotBits, sizeof(int));
+	rehashSlots(histogram);
+}
+
+static void addToSums (uint64_t* sums, uint32_t color, int count)
+{
+	sums[0] += (uint64_t)(color & 0xff) * count;
+	sums[1] += (uint64_t)((color >> 8) & 0xff) * count;
+	sums[2] += (uint64_t)((color >> 16) & 0xff) * count;
+	sums[3] += (uint64_t)(color >> 24) * count;
+}
+
+void addToHistogram (struct Histogram* histogram, uint32_t color, int count)
+{
+	uint32_t key = histogram->quantBits != 0 ? color & histogram->quantMask : color;
+
+	// keep the table at most half full
+	if (histogram->slots == NULL || (histogram->size + 1) * 2 > ((size_t)1 << histogram->slotBits))
+		growSlots(histogram);
+
+	int* slot = findSlot(histogram, key);
+
+	if (*slot != 0)
+	{
+		histogram->counts[*slot - 1] += count;
+		if (histogram->quantBits != 0)
+			addToSums(histogram->sums + (*slot - 1) * 4, color, count);
+		return;
+	}
+
+	if (histogram->size == histogram->capacity)
+	{
+		histogram->capacity = histogram->capacity == 0 ? 256 : histogram->capacity * 2;
+		histogram->colors = realloc(histogram->colors, histogram->capacity * sizeof(uint32_t));
+		histogram->counts = realloc(histogram->counts, histogram->capacity * sizeof(int));
+		if (histogram->quantBits != 0)
+			growSums(histogram);
+	}
+	histogram->colors[histogram->size] = key;
+	histogram->counts[histogram->size] = count;
+	if (histogram->quantBits != 0)
+	{
+		memset(histogram->sums + histogram->size * 4, 0, 4 * sizeof(uint64_t));
+		addToSums(histogram->sums + histogram->size * 4, color, count);
+	}
+	*slot = ++histogram->size;
+}
+
+void fillHistogram (struct Histogram* histogram, const uint32_t* pixels, size_t numpixels)
+{
+	size_t i = 0;
+
+	while (i < numpixels)
+	{
+		uint32_t color = pixels[i];
+		int count = 1;
+
+		// runs of the same colour are common in artwork, count them with a single lookup
+		while (++i < numpixels && pixels[i] == color)
+			++count;
+		addToHistogram(histogram, color, count);
+	}
+}
+
+void mergeHistogram (struct Histogram* histogram, const struct Histogram* source)
+{
+	for (size_t i = 0; i < source->size; ++i)
+	{
+		// quantised keys are on their bucket already, their member sums carry over as they are
+		addToHistogram(histogram, source->colors[i], source->quantBits == 0 ? source->counts[i] : 0);
+		if (source->quantBits != 0)
+		{
+			size_t index = *findSlot(histogram, source->colors[i]) - 1;
+
+			histogram->counts[index] += source->counts[i];
+			for (int c = 0; c < 4; ++c)
+				histogram->sums[index * 4 + c] += source->sums[i * 4 + c];
+		}
+	}
+}
+
+void resolveHistogramMeans (struct Histogram* histogram)
+{
+	if (histogram->quantBits == 0 || histogram->size == 0)
+		return;
+
+	// a rounded mean stays inside its bucket, so the means are as distinct as the buckets were
+	for (size_t i = 0; i < histogram->size; ++i)
+	{
+		const uint64_t* sums = histogram->sums + i * 4;
+		uint64_t count = histogram->counts[i];
+		uint64_t half = count / 2;
+
+		histogram->colors[i] = PACKRGBA((sums[0] + half) / count, (sums[1] + half) / count,
+				(sums[2] + half) / count, (sums[3] + half) / count);
+	}
+	rehashSlots(histogram);
+}
+
+size_t histogramUsedBytes (const struct Histogram* histogram)
+{
+	// the colours in it with their slots at the table's load limit, not the room a reused histogram kept
+	size_t sums = histogram->quantBits != 0 ? 4 * sizeof(uint64_t) : 0;
+
+	return histogram->size * (sizeof(uint32_t) + sizeof(int) + 2 * sizeof(int) + sums);
+}
+
+int histogramCount (const struct Histogram* histogram, uint32_t color)
+{
+	if (histogram->size == 0)
+		return 0;
+
+	int slot = *findSlot(histogram, color);
+
+	return slot == 0 ? 0 : histogram->counts[slot - 1];
+}
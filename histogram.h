@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// colour -> pixel count, colours and counts are kept dense in insertion order
+struct Histogram
+{
+	uint32_t* colors;
+	int* counts;
+	size_t size;
+	size_t capacity;
+
+	// open addressing table of index + 1 into colors, 0 marks an empty slot
+	int* slots;
+	int slotBits;
+
+	// with quantBits (1..7) colours are bucketed on their top bits per channel, the channel sums of each
+	// bucket's members are kept in sums (r, g, b, a per colour) until resolveHistogramMeans replaces the
+	// bucket keys by the weighted mean of their members
+	int quantBits;
+	uint32_t quantMask;
+	uint64_t* sums;
+	size_t sumsCapacity; // colours sums has room for, it may lag capacity while quantBits is 0
+};
+
+struct Histogram* createHistogram ();
+void freeHistogram (struct Histogram* histogram);
+void clearHistogram (struct Histogram* histogram);
+void setHistogramQuantBits (struct Histogram* histogram, int bits);
+
+void addToHistogram (struct Histogram* histogram, uint32_t color, int count);
+void fillHistogram (struct Histogram* histogram, const uint32_t* pixels, size_t numpixels);
+// adds the colours of source in its insertion order, before either is resolved
+void mergeHistogram (struct Histogram* histogram, const struct Histogram* source);
+// after the last fill of a quantised histogram, nothing to do otherwise
+void resolveHistogramMeans (struct Histogram* histogram);
+int histogramCount (const struct Histogram* histogram, uint32_t color);
+size_t histogramUsedBytes (const struct Histogram* histogram); // of its colours, not of its capacity
@@ -0,0 +1,348 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "input.h"
+#include "readahead.h"
+#include "cover.h"
+#include "cache.h"
+
+#define STDINNAME "-"
+#define STDINCHUNK (1 << 20)
+
+struct DirWalk
+{
+	char* path;
+	struct dirent** entries;
+	int count;
+	int index;
+};
+
+void initInputSource (struct InputSource* source, char** args, int count, int framed, int recursive, const char* extensions, int readahead)
+{
+	memset(source, 0, sizeof(struct InputSource));
+	source->args = args;
+	source->count = count;
+	source->index = 0;
+	source->framed = framed;
+	source->recursive = recursive;
+	source->extensions = extensions;
+	if (readahead > 0)
+		source->readahead = createReadAhead(readahead);
+}
+
+void skipCachedReadAhead (struct InputSource* source, const struct ResultCache* cache, uint64_t optionshash)
+{
+	source->cache = cache;
+	source->optionshash = optionshash;
+}
+
+// whether the file is worth reading ahead, a cached result makes its bytes useless
+static int readAheadBody (const struct InputSource* source, const char* path)
+{
+	struct ImageData data;
+	struct stat st;
+
+	if (isAudioFile(path))
+		return 0;
+	if (source->cache == NULL || stat(path, &st) != 0)
+		return 1;
+	memset(&data, 0, sizeof(data));
+	return !lookupResult(source->cache, path, &st, source->optionshash, &data);
+}
+
+static void popDirectory (struct InputSource* source)
+{
+	struct DirWalk* dir = &source->walk[--source->walkdepth];
+
+	for (int i = 0; i < dir->count; ++i)
+		free(dir->entries[i]);
+	free(dir->entries);
+	free(dir->path);
+}
+
+void freeInputSource (struct InputSource* source)
+{
+	while (source->walkdepth > 0)
+		popDirectory(source);
+	free(source->walk);
+	if (source->readahead != NULL)
+		freeReadAhead(source->readahead);
+	free(source->held);
+	source->walk = NULL;
+	source->readahead = NULL;
+	source->held = NULL;
+}
+
+static int notdots (const struct dirent* entry)
+{
+	return strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0;
+}
+
+static void pushDirectory (struct InputSource* source, const char* path)
+{
+	struct DirWalk* dir;
+	struct dirent** entries;
+	int count = scandir(path, &entries, &notdots, &alphasort);
+
+	if (count < 0)
+	{
+		fprintf(stderr, "could not read directory '%s'\n", path);
+		return;
+	}
+	if (source->walkdepth == source->walkcapacity)
+	{
+		source->walkcapacity = source->walkcapacity == 0 ? 8 : source->walkcapacity * 2;
+		source->walk = realloc(source->walk, source->walkcapacity * sizeof(struct DirWalk));
+	}
+	dir = &source->walk[source->walkdepth++];
+	dir->path = strdup(path);
+	dir->entries = entries;
+	dir->count = count;
+	dir->index = 0;
+}
+
+static int matchesExtension (const char* name, const char* extensions)
+{
+	const char* dot = strrchr(name, '.');
+	size_t length;
+
+	if (extensions == NULL)
+		return 1;
+	if (dot == NULL)
+		return 0;
+
+	length = strlen(++dot);
+	while (*extensions != 0)
+	{
+		const char* end = strchr(extensions, ',');
+		size_t extlength = end != NULL ? (size_t)(end - extensions) : strlen(extensions);
+
+		if (extlength == length && strncasecmp(extensions, dot, length) == 0)
+			return 1;
+		extensions += extlength;
+		if (*extensions == ',')
+			++extensions;
+	}
+	return 0;
+}
+
+// the next argument, or file of the directories being walked
+static char* nextPath (struct InputSource* source)
+{
+	while (source->walkdepth > 0 || source->index < source->count)
+	{
+		struct stat st;
+
+		if (source->walkdepth > 0)
+		{
+			struct DirWalk* dir = &source->walk[source->walkdepth - 1];
+
+			if (dir->index == dir->count)
+			{
+				popDirectory(source);
+				continue;
+			}
+
+			const char* name = dir->entries[dir->index++]->d_name;
+			size_t dirlength = strlen(dir->path);
+			int separator = dirlength > 0 && dir->path[dirlength - 1] != '/';
+			char* path = malloc(dirlength + separator + strlen(name) + 1);
+
+			sprintf(path, separator ? "%s/%s" : "%s%s", dir->path, name);
+			// subdirectories are walked before the rest of this one, links to directories are not followed
+			if (lstat(path, &st) == 0 && S_ISDIR(st.st_mode))
+				pushDirectory(source, path);
+			else if (stat(path, &st) == 0 && S_ISREG(st.st_mode) && matchesExtension(name, source->extensions))
+				return path;
+			free(path);
+			continue;
+		}
+
+		const char* arg = source->args[source->index++];
+
+		if (source->recursive && strcmp(arg, STDINNAME) != 0 && stat(arg, &st) == 0 && S_ISDIR(st.st_mode))
+		{
+			pushDirectory(source, arg);
+			continue;
+		}
+		return strdup(arg);
+	}
+	return NULL;
+}
+
+static int readall (FILE* in, struct InputJob* job)
+{
+	size_t capacity = 0;
+
+	job->blob = NULL;
+	job->bloblength = 0;
+	while (!feof(in) && !ferror(in))
+	{
+		if (job->bloblength == capacity)
+		{
+			void* blob;
+
+			// a full buffer at the limit is fine only if nothing follows
+			if (capacity == MAXBLOBLENGTH)
+			{
+				if (fgetc(in) == EOF)
+					break;
+				fprintf(stderr, "stdin is larger than %d bytes\n", MAXBLOBLENGTH);
+				free(job->blob);
+				job->blob = NULL;
+				job->bloblength = 0;
+				return 0;
+			}
+			capacity = capacity + STDINCHUNK < MAXBLOBLENGTH ? capacity + STDINCHUNK : MAXBLOBLENGTH;
+			blob = realloc(job->blob, capacity);
+			if (blob == NULL)
+			{
+				free(job->blob);
+				job->blob = NULL;
+				job->bloblength = 0;
+				return 0;
+			}
+			job->blob = blob;
+		}
+		job->bloblength += fread((char*)job->blob + job->bloblength, 1, capacity - job->bloblength, in);
+	}
+	return job->bloblength > 0;
+}
+
+static int readframe (FILE* in, struct InputJob* job)
+{
+	size_t length = 0;
+	int c;
+	int digits = 0;
+
+	while ((c = fgetc(in)) >= '0' && c <= '9')
+	{
+		// past the limit the length is only kept above it, it cannot overflow
+		if (length <= MAXBLOBLENGTH)
+			length = length * 10 + (c - '0');
+		++digits;
+	}
+	if (c == EOF && digits == 0)
+		return 0;
+	if (c != '\n' || digits == 0 || length == 0)
+	{
+		fprintf(stderr, "bad frame header on stdin\n");
+		return 0;
+	}
+	if (length > MAXBLOBLENGTH)
+	{
+		fprintf(stderr, "frame on stdin is larger than %d bytes\n", MAXBLOBLENGTH);
+		return 0;
+	}
+
+	job->blob = malloc(length);
+	job->bloblength = length;
+	if (job->blob == NULL || fread(job->blob, 1, length, in) != length)
+	{
+		fprintf(stderr, "truncated frame on stdin\n");
+		free(job->blob);
+		job->blob = NULL;
+		job->bloblength = 0;
+		return 0;
+	}
+	return 1;
+}
+
+int nextInput (struct InputSource* source, struct InputJob* job)
+{
+	for (;;)
+	{
+		char* path;
+
+		job->blob = NULL;
+		job->bloblength = 0;
+		job->fileblob = 0;
+
+		// keep the files up to the next stdin argument in flight, stdin is read in its turn
+		while (source->readahead != NULL && source->held == NULL && !readAheadFull(source->readahead))
+		{
+			path = nextPath(source);
+			if (path == NULL)
+				break;
+			if (strcmp(path, STDINNAME) == 0)
+				source->held = path;
+			else
+				pushReadAhead(source->readahead, path, readAheadBody(source, path));
+		}
+		if (source->readahead != NULL && !readAheadEmpty(source->readahead))
+		{
+			job->filepath = popReadAhead(source->readahead, &job->blob, &job->bloblength);
+			job->fileblob = job->blob != NULL;
+			return 1;
+		}
+
+		path = source->held != NULL ? source->held : nextPath(source);
+		source->held = NULL;
+		if (path == NULL)
+			return 0;
+
+		job->filepath = path;
+		if (strcmp(path, STDINNAME) != 0)
+			return 1;
+
+		if (source->framed)
+		{
+			// the argument stays until the end of stdin
+			if (readframe(stdin, job))
+			{
+				source->held = strdup(STDINNAME);
+				return 1;
+			}
+			freeInputJob(job);
+			continue;
+		}
+
+		if (readall(stdin, job))
+			return 1;
+		freeInputJob(job);
+	}
+}
+
+void freeInputJob (struct InputJob* job)
+{
+	free(job->filepath);
+	free(job->blob);
+	job->filepath = NULL;
+	job->blob = NULL;
+	job->bloblength = 0;
+	job->fileblob = 0;
+}
+
+void* mapInputFile (const char* filepath, size_t* length)
+{
+	int fd = open(filepath, O_RDONLY);
+	struct stat st;
+	void* map = NULL;
+
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED)
+			map = NULL;
+		else
+		{
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			*length = st.st_size;
+		}
+	}
+	close(fd);
+	return map;
+}
+
+void unmapInputFile (void* map, size_t length)
+{
+	munmap(map, length);
+}
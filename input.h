@@ -0,0 +1,53 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+// an image to analyse, either a path or bytes already in memory
+struct InputJob
+{
+	char* filepath; // owned by the job
+	void* blob; // owned by the job
+	size_t bloblength;
+	int fileblob; // blob holds the contents of filepath, read ahead
+};
+
+// largest image taken from stdin, a stdin frame or a --serve blob
+#define MAXBLOBLENGTH (256 << 20)
+
+struct DirWalk;
+struct ReadAhead;
+struct ResultCache;
+
+// walks the image arguments, '-' reads stdin: a single image, or with framed
+// a stream of images each preceded by its length in bytes as a decimal line.
+// with recursive, directory arguments are walked depth first in name order for files with
+// one of the comma separated extensions (all files when NULL).
+// with readahead > 0 that many of the next files are read while earlier ones are analysed
+struct InputSource
+{
+	char** args;
+	int count;
+	int index;
+	int framed;
+
+	int recursive;
+	const char* extensions;
+	struct DirWalk* walk; // stack of the directories being walked
+	int walkdepth;
+	int walkcapacity;
+
+	struct ReadAhead* readahead;
+	char* held; // stdin argument waiting for the files read ahead before it
+	const struct ResultCache* cache; // files with a result in it are not read ahead, see skipCachedReadAhead
+	uint64_t optionshash;
+};
+
+void initInputSource (struct InputSource* source, char** args, int count, int framed, int recursive, const char* extensions, int readahead);
+void freeInputSource (struct InputSource* source);
+// files the cache has a result for are queued without reading them, their bytes are not needed
+void skipCachedReadAhead (struct InputSource* source, const struct ResultCache* cache, uint64_t optionshash);
+int nextInput (struct InputSource* source, struct InputJob* job);
+void freeInputJob (struct InputJob* job);
+
+void* mapInputFile (const char* filepath, size_t* length);
+void unmapInputFile (void* map, size_t length);
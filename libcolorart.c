@@ -0,0 +1,105 @@
+#include <string.h>
+#include <limits.h>
+#include "libcolorart.h"
+#include "colorart.h"
+#include "analyse.h"
+#include "color.h"
+#include "histogram.h"
+#include "workspace.h"
+
+struct ColorArtContext
+{
+	struct ImageData data;
+	int quantbits;
+	int threads;
+};
+
+struct ColorArtContext* colorartCreateContext (void)
+{
+	struct ColorArtContext* context = calloc(1, sizeof(struct ColorArtContext));
+
+	if (context != NULL)
+	{
+		context->data.workspace = createWorkspace();
+		context->threads = 1;
+	}
+	return context;
+}
+
+void colorartFreeContext (struct ColorArtContext* context)
+{
+	freeWorkspace(context->data.workspace);
+	free(context);
+}
+
+int colorartSetQuantBits (struct ColorArtContext* context, int bits)
+{
+	if (bits < 0 || bits > 7)
+		return 0;
+	context->quantbits = bits;
+	return 1;
+}
+
+void colorartSetThreads (struct ColorArtContext* context, int threads)
+{
+	context->threads = threads > 1 ? threads : 1;
+}
+
+static struct ColorArtColor makeResultColor (const struct NormalColor* color)
+{
+	struct ColorArtColor result;
+
+	result.r = CHARCOL(color->r);
+	result.g = CHARCOL(color->g);
+	result.b = CHARCOL(color->b);
+	return result;
+}
+
+int colorartAnalyseRGBA (struct ColorArtContext* context, const unsigned char* rgba, size_t width, size_t height, size_t stride, double maxsaturation, struct ColorArtResult* result)
+{
+	struct ImageData* data = &context->data;
+	size_t numpixels;
+
+	if (rgba == NULL || width == 0 || height == 0)
+		return 0;
+	// the rows and the pixel buffer must be addressable, and the histogram counts pixels in an int
+	if (width > SIZE_MAX / 4 || stride < width * 4 || height - 1 > (SIZE_MAX - width * 4) / stride
+		|| height > INT_MAX / width || height > SIZE_MAX / sizeof(uint32_t) / width)
+		return 0;
+	numpixels = width * height;
+
+	data->pixels = workspacePixels(data->workspace, numpixels);
+	if (data->pixels == NULL)
+		return 0;
+
+	data->width = width;
+	data->height = height;
+	data->filepath = NULL;
+	for (size_t y = 0; y < height; ++y)
+		memcpy(data->pixels + y * width, rgba + y * stride, width * sizeof(uint32_t));
+
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	// RGBA bytes in memory, PACKRGBA wants red in the low byte
+	for (size_t i = 0; i < numpixels; ++i)
+		data->pixels[i] = __builtin_bswap32(data->pixels[i]);
+#endif
+
+	data->histogram = workspaceHistogram(data->workspace, context->quantbits);
+	data->edgeColumn = NULL;
+
+	if (context->threads > 1)
+		analyseimageThreaded(data, context->threads);
+	else
+	{
+		fillHistogram(data->histogram, data->pixels, numpixels);
+		resolveHistogramMeans(data->histogram);
+		analyseimage(data);
+	}
+	ensuresaturation(data, maxsaturation);
+
+	result->background = makeResultColor(&data->backgroundColor);
+	result->primary = makeResultColor(&data->primaryColor);
+	result->secondary = makeResultColor(&data->secondaryColor);
+	result->detail = makeResultColor(&data->detailColor);
+	return 1;
+}
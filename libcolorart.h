@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// the library is built with hidden symbols, only these functions are exported
+#if defined(__GNUC__)
+#define COLORART_API __attribute__((visibility("default")))
+#else
+#define COLORART_API
+#endif
+
+struct ColorArtColor
+{
+	unsigned char r, g, b;
+};
+
+struct ColorArtResult
+{
+	struct ColorArtColor background;
+	struct ColorArtColor primary;
+	struct ColorArtColor secondary;
+	struct ColorArtColor detail;
+};
+
+// analysis state, reused across images: buffers grow to the largest image seen and are kept.
+// a context is not shared between threads, use one per thread
+struct ColorArtContext;
+
+COLORART_API struct ColorArtContext* colorartCreateContext (void);
+COLORART_API void colorartFreeContext (struct ColorArtContext* context);
+
+// groups colours on their top bits per channel (1..7, 0 for none) before looking for text colours,
+// each group counts as the weighted mean of its colours. returns 0 and keeps the setting for other values
+COLORART_API int colorartSetQuantBits (struct ColorArtContext* context, int bits);
+
+// counts the colors of each image on this many threads (default 1), it lowers the latency of large images
+COLORART_API void colorartSetThreads (struct ColorArtContext* context, int threads);
+
+// analyses width x height pixels of 8-bit RGBA, rows are stride bytes apart.
+// maxsaturation limits the saturation of the result colors (0..1, 1 for no limit).
+// returns 0 when the buffer is unusable, as when its size overflows or it has more than INT_MAX pixels
+COLORART_API int colorartAnalyseRGBA (struct ColorArtContext* context, const unsigned char* rgba, size_t width, size_t height, size_t stride, double maxsaturation, struct ColorArtResult* result);
+
+#ifdef __cplusplus
+}
+#endif
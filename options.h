@@ -0,0 +1,70 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include "colorart.h"
+#include "format.h"
+
+struct ResultCache;
+struct StatsSummary;
+
+struct Options
+{
+	double maxsaturation; // 0.628;
+	const char* format;
+	enum OutputMode output;
+	struct FormatProgram* program; // format and output compiled, see compileFormat
+	int printfilename;
+	int quiet;
+	int jobs;
+	int unordered;
+	int backgroundonly;
+	int stream;
+	size_t maxpixels; // 0: no limit
+	enum
+	{
+		RESAMPLESCALE,
+		RESAMPLESAMPLE,
+		RESAMPLERESIZE,
+	} resample;
+	int quantbits; // 0: every colour counts on its own
+	int threads; // per image, see analyseimageThreaded
+	enum
+	{
+		FRAMESFIRST,
+		FRAMESALL,
+		FRAMESMERGE,
+	} frames;
+	enum
+	{
+		SAMPLENONE,
+		SAMPLESTRIDE,
+		SAMPLERANDOM,
+	} sample;
+	size_t samplesize; // stride, or number of pixels
+	uint32_t seed;
+	int usemmap;
+	int framed;
+	int recursive;
+	const char* extensions; // comma separated, NULL for all files
+	int readahead;
+	const char* servepath;
+	const char* cachepath;
+	int cacherebuild;
+	int cachecompact;
+	int cachebypass;
+	struct ResultCache* cache;
+	enum
+	{
+		STATSOFF,
+		STATSTEXT,
+		STATSJSON,
+	} stats;
+	struct StatsSummary* statssummary; // whole run, NULL when not summarised
+	uint64_t optionshash;
+};
+
+// derived options, after format, quiet or analysis options changed
+void updatederivedoptions (struct Options* options);
+int processimage (struct ImageData* data, const void* context, FILE* out, FILE* err);
+// the wand and workspace processimage keeps in data from one image to the next
+void releaseimagedata (struct ImageData* data);
@@ -0,0 +1,310 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include "readahead.h"
+#include "input.h"
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#define HAVEIOURING 1
+#endif
+#endif
+
+// one read per file, no larger than an image from stdin. files past either limit are only prefetched
+#define MAXRINGREAD MAXBLOBLENGTH
+#define MAXRINGBYTES MAXBLOBLENGTH // of the blobs read ahead and not yet popped
+
+struct PendingRead
+{
+	char* path;
+	int fd; // open while the read is in flight
+	void* blob;
+	size_t length;
+	long result; // bytes read, or a negative errno
+	int done;
+};
+
+#ifdef HAVEIOURING
+// the submission and completion rings shared with the kernel, without liburing
+struct Ring
+{
+	int fd;
+	unsigned* sqtail;
+	unsigned* sqmask;
+	unsigned* sqarray;
+	struct io_uring_sqe* sqes;
+	unsigned* cqhead;
+	unsigned* cqtail;
+	unsigned* cqmask;
+	struct io_uring_cqe* cqes;
+
+	void* sqmap;
+	size_t sqmaplength;
+	void* cqmap;
+	size_t cqmaplength;
+	size_t sqeslength;
+};
+#endif
+
+struct ReadAhead
+{
+	// first in first out ring of depth reads, the slot index tags ring completions
+	struct PendingRead* reads;
+	int depth;
+	int first;
+	int count;
+#ifdef HAVEIOURING
+	struct Ring ring;
+	int ringready;
+	int usering;
+	size_t ringbytes;
+#endif
+};
+
+#ifdef HAVEIOURING
+static void teardownRing (struct Ring* ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqeslength);
+	if (ring->cqmap != NULL && ring->cqmap != MAP_FAILED && ring->cqmap != ring->sqmap)
+		munmap(ring->cqmap, ring->cqmaplength);
+	if (ring->sqmap != NULL && ring->sqmap != MAP_FAILED)
+		munmap(ring->sqmap, ring->sqmaplength);
+	close(ring->fd);
+}
+
+static int setupRing (struct Ring* ring, unsigned entries)
+{
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(struct Ring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if (ring->fd < 0)
+		return 0;
+
+	ring->sqmaplength = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqmaplength = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqeslength = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	// newer kernels map both rings at once
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+	{
+		if (ring->cqmaplength > ring->sqmaplength)
+			ring->sqmaplength = ring->cqmaplength;
+		ring->sqmap = mmap(NULL, ring->sqmaplength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+		ring->cqmap = ring->sqmap;
+	}
+	else
+	{
+		ring->sqmap = mmap(NULL, ring->sqmaplength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+		ring->cqmap = mmap(NULL, ring->cqmaplength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	}
+	ring->sqes = mmap(NULL, ring->sqeslength, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqmap == MAP_FAILED || ring->cqmap == MAP_FAILED || ring->sqes == MAP_FAILED)
+	{
+		teardownRing(ring);
+		return 0;
+	}
+
+	ring->sqtail = (unsigned*)((char*)ring->sqmap + params.sq_off.tail);
+	ring->sqmask = (unsigned*)((char*)ring->sqmap + params.sq_off.ring_mask);
+	ring->sqarray = (unsigned*)((char*)ring->sqmap + params.sq_off.array);
+	ring->cqhead = (unsigned*)((char*)ring->cqmap + params.cq_off.head);
+	ring->cqtail = (unsigned*)((char*)ring->cqmap + params.cq_off.tail);
+	ring->cqmask = (unsigned*)((char*)ring->cqmap + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)((char*)ring->cqmap + params.cq_off.cqes);
+	return 1;
+}
+
+static int submitRead (struct Ring* ring, const struct PendingRead* read, int slot)
+{
+	unsigned tail = *ring->sqtail;
+	unsigned index = tail & *ring->sqmask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	int submitted;
+
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = read->fd;
+	sqe->addr = (unsigned long)read->blob;
+	sqe->len = read->length;
+	sqe->off = 0;
+	sqe->user_data = slot;
+	ring->sqarray[index] = index;
+	__atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+
+	do
+		submitted = syscall(__NR_io_uring_enter, ring->fd, 1, 0, 0, NULL, 0);
+	while (submitted < 0 && errno == EINTR);
+
+	// not consumed by the kernel, take it back
+	if (submitted != 1)
+		__atomic_store_n(ring->sqtail, tail, __ATOMIC_RELEASE);
+	return submitted == 1;
+}
+
+static void reapCompletions (struct ReadAhead* readahead)
+{
+	struct Ring* ring = &readahead->ring;
+	unsigned head = *ring->cqhead;
+	unsigned tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+
+	if (head == tail)
+	{
+		syscall(__NR_io_uring_enter, ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+	}
+	for (; head != tail; ++head)
+	{
+		const struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cqmask];
+		struct PendingRead* read = &readahead->reads[cqe->user_data];
+
+		read->result = cqe->res;
+		read->done = 1;
+	}
+	__atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+}
+#endif
+
+struct ReadAhead* createReadAhead (int depth)
+{
+	struct ReadAhead* readahead = calloc(1, sizeof(struct ReadAhead));
+
+	readahead->depth = depth > 0 ? depth : 1;
+	readahead->reads = calloc(readahead->depth, sizeof(struct PendingRead));
+#ifdef HAVEIOURING
+	// fails on old kernels and where io_uring is disabled, prefetching still works there
+	readahead->ringready = setupRing(&readahead->ring, readahead->depth);
+	readahead->usering = readahead->ringready;
+#endif
+	return readahead;
+}
+
+void freeReadAhead (struct ReadAhead* readahead)
+{
+	// reads in flight still write into their blobs
+	while (!readAheadEmpty(readahead))
+	{
+		void* blob;
+		size_t length;
+
+		free(popReadAhead(readahead, &blob, &length));
+		free(blob);
+	}
+#ifdef HAVEIOURING
+	if (readahead->ringready)
+		teardownRing(&readahead->ring);
+#endif
+	free(readahead->reads);
+	free(readahead);
+}
+
+int readAheadFull (const struct ReadAhead* readahead)
+{
+	return readahead->count == readahead->depth;
+}
+
+int readAheadEmpty (const struct ReadAhead* readahead)
+{
+	return readahead->count == 0;
+}
+
+void pushReadAhead (struct ReadAhead* readahead, char* path, int readbody)
+{
+	int slot = (readahead->first + readahead->count) % readahead->depth;
+	struct PendingRead* read = &readahead->reads[slot];
+	struct stat st;
+	int fd;
+
+	memset(read, 0, sizeof(struct PendingRead));
+	read->path = path;
+	read->fd = -1;
+	read->done = 1;
+	++readahead->count;
+	if (!readbody)
+		return;
+
+	// files that cannot be opened are left to the decoder, which reports them
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+
+#ifdef HAVEIOURING
+	if (readahead->usering && st.st_size <= MAXRINGREAD && readahead->ringbytes + st.st_size <= MAXRINGBYTES
+		&& (read->blob = malloc(st.st_size)) != NULL)
+	{
+		read->fd = fd;
+		read->length = st.st_size;
+		read->done = 0;
+		if (submitRead(&readahead->ring, read, slot))
+		{
+			readahead->ringbytes += read->length;
+			return;
+		}
+
+		free(read->blob);
+		read->blob = NULL;
+		read->length = 0;
+		read->fd = -1;
+		read->done = 1;
+	}
+#endif
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+char* popReadAhead (struct ReadAhead* readahead, void** blob, size_t* length)
+{
+	struct PendingRead* read = &readahead->reads[readahead->first];
+
+#ifdef HAVEIOURING
+	while (!read->done)
+		reapCompletions(readahead);
+	// kernels before 5.6 have no IORING_OP_READ
+	if (read->result == -EINVAL)
+		readahead->usering = 0;
+	readahead->ringbytes -= read->length;
+#endif
+	readahead->first = (readahead->first + 1) % readahead->depth;
+	--readahead->count;
+
+	*blob = NULL;
+	*length = 0;
+	if (read->blob != NULL)
+	{
+		size_t got = read->result > 0 ? read->result : 0;
+
+		// short and failed reads are finished here
+		while (got < read->length)
+		{
+			ssize_t n = pread(read->fd, (char*)read->blob + got, read->length - got, got);
+
+			if (n <= 0 && !(n < 0 && errno == EINTR))
+				break;
+			if (n > 0)
+				got += n;
+		}
+		if (got == read->length)
+		{
+			*blob = read->blob;
+			*length = got;
+		}
+		else
+			free(read->blob);
+	}
+	if (read->fd >= 0)
+		close(read->fd);
+	return read->path;
+}
@@ -0,0 +1,19 @@
+#pragma once
+#include <stddef.h>
+
+// reads the next files into memory while earlier ones are analysed, in first in first out order.
+// with io_uring the file bodies are read asynchronously into blobs, without it the kernel is only
+// told to prefetch them (posix_fadvise) and the files are read by path as usual
+struct ReadAhead;
+
+struct ReadAhead* createReadAhead (int depth);
+void freeReadAhead (struct ReadAhead* readahead);
+
+int readAheadFull (const struct ReadAhead* readahead);
+int readAheadEmpty (const struct ReadAhead* readahead);
+
+// path is kept, and given back by popReadAhead. without readbody the file is only queued in its
+// turn, for files of which the decoder reads a part (the cover of audio files) or nothing (cached results)
+void pushReadAhead (struct ReadAhead* readahead, char* path, int readbody);
+// waits for the oldest file. blob is NULL when the file was only prefetched or could not be read
+char* popReadAhead (struct ReadAhead* readahead, void** blob, size_t* length);
@@ -0,0 +1,571 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "serve.h"
+#include "input.h"
+
+#define LISTENBACKLOG 64
+#define READCHUNK (64 << 10)
+#define MAXLINELENGTH (64 << 10)
+#define IDLESECONDS 60 // a connection without a request for this long is closed
+#define SENDSECONDS 10 // a client that does not take its answer for this long is dropped
+// without -F and a format request, the colors of the CLI's debug output on one line
+#define DEFAULTFORMAT "background %b primary %p secondary %s detail %d"
+
+enum
+{
+	REQUESTINCOMPLETE, // more input is needed
+	REQUESTANSWERED,
+	REQUESTCLOSE,
+};
+
+// a client and the options its requests set. the poller watches it while it waits for input,
+// a worker holds it for the length of one request
+struct Connection
+{
+	int fd;
+	FILE* out;
+	char* input; // read and not yet answered
+	size_t length;
+	size_t capacity;
+	size_t wanted; // input the pending request needs in all, when more than its line
+	int readable; // the poller saw input, a read does not block
+	time_t lastrequest;
+
+	const struct Options* serveroptions;
+	struct Options options;
+	char* format;
+	struct FormatProgram* program; // of format, the server's program is shared
+
+	struct Connection* next; // in the ready or returned list
+};
+
+struct Server
+{
+	int listenfd;
+	int wakefds[2]; // workers wake the poller with connections to watch again
+	const struct Options* options;
+
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	int stopping;
+	struct Connection* ready; // waiting for a worker, in order
+	struct Connection* readytail;
+	struct Connection* returned; // waiting for the poller
+};
+
+// set by SIGINT and SIGTERM, which also write to the wake pipe of the poller
+static volatile sig_atomic_t stopsignalled;
+static int stopwakefd = -1;
+
+static void stopserver (int signum)
+{
+	int saved = errno;
+
+	(void)signum;
+	stopsignalled = 1;
+	while (write(stopwakefd, "", 1) < 0 && errno == EINTR)
+		;
+	errno = saved;
+}
+
+// whether a server answers at the socket path
+static int socketinuse (const struct sockaddr_un* address)
+{
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	int inuse;
+
+	if (fd < 0)
+		return 0;
+	inuse = connect(fd, (const struct sockaddr*)address, sizeof(*address)) == 0;
+	close(fd);
+	return inuse;
+}
+
+static time_t monotonicseconds ()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec;
+}
+
+static struct Connection* openconnection (int fd, const struct Options* serveroptions)
+{
+	struct Connection* connection = calloc(1, sizeof(struct Connection));
+	struct timeval timeout = { SENDSECONDS, 0 };
+	int dupfd = dup(fd);
+
+	connection->fd = fd;
+	connection->out = dupfd >= 0 ? fdopen(dupfd, "w") : NULL;
+	if (connection->out == NULL)
+	{
+		if (dupfd >= 0)
+			close(dupfd);
+		close(fd);
+		free(connection);
+		return NULL;
+	}
+	// the listening socket does not block, the connection does: its writes wait for the client, up to the timeout
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	connection->lastrequest = monotonicseconds();
+
+	connection->serveroptions = serveroptions;
+	connection->options = *serveroptions;
+	// nothing goes to the debug output of a server
+	connection->options.quiet = 1;
+	updatederivedoptions(&connection->options);
+	return connection;
+}
+
+static void closeconnection (struct Connection* connection)
+{
+	fclose(connection->out);
+	close(connection->fd);
+	free(connection->input);
+	free(connection->format);
+	freeFormat(connection->program);
+	free(connection);
+}
+
+// one read, only when the poller saw input
+static int readinput (struct Connection* connection)
+{
+	size_t size = connection->length + READCHUNK;
+	ssize_t length;
+
+	if (size < connection->wanted)
+		size = connection->wanted;
+	if (size > connection->capacity)
+	{
+		char* input = realloc(connection->input, size);
+
+		if (input == NULL)
+			return 0;
+		connection->input = input;
+		connection->capacity = size;
+	}
+	connection->readable = 0;
+	do
+		length = read(connection->fd, connection->input + connection->length, connection->capacity - connection->length);
+	while (length < 0 && errno == EINTR);
+	if (length <= 0)
+		return 0;
+	connection->length += length;
+	return 1;
+}
+
+// answers the first request of the input when all of it is there
+static int answerrequest (struct Connection* connection, struct ImageData* data)
+{
+	struct Options* options = &connection->options;
+	FILE* out = connection->out;
+	char* line = connection->input;
+	char* newline = connection->length > 0 ? memchr(line, '\n', connection->length) : NULL;
+	size_t consumed;
+	char* argument;
+
+	if (newline == NULL)
+	{
+		if (connection->length > MAXLINELENGTH)
+		{
+			fprintf(out, "error request longer than %d bytes\n", MAXLINELENGTH);
+			return REQUESTCLOSE;
+		}
+		return REQUESTINCOMPLETE;
+	}
+	*newline = 0;
+	consumed = newline + 1 - line;
+	argument = strchr(line, ' ');
+	if (argument != NULL)
+		*argument++ = 0;
+	else
+		argument = newline;
+
+	if (strcmp(line, "blob") == 0)
+	{
+		size_t length = strtoul(argument, NULL, 10);
+
+		if (length == 0 || length > MAXBLOBLENGTH)
+		{
+			fprintf(out, "error bad blob\n");
+			return REQUESTCLOSE;
+		}
+		if (connection->length - consumed < length)
+		{
+			// the line is parsed again once the blob is in
+			if (argument != newline)
+				argument[-1] = ' ';
+			*newline = '\n';
+			connection->wanted = consumed + length;
+			return REQUESTINCOMPLETE;
+		}
+		// the blob is read from the input as it is
+		data->filepath = "blob";
+		data->blob = newline + 1;
+		data->bloblength = length;
+		if (!processimage(data, options, out, stderr))
+			fprintf(out, "error could not read blob\n");
+		data->blob = NULL;
+		consumed += length;
+	}
+	else if (strcmp(line, "format") == 0)
+	{
+		free(connection->format);
+		freeFormat(connection->program);
+		connection->format = NULL;
+		connection->program = NULL;
+		// an empty format goes back to the server's
+		if (*argument != 0)
+		{
+			connection->format = strdup(argument);
+			connection->program = compileFormat(connection->format, options->output);
+		}
+		options->format = connection->format != NULL ? connection->format : connection->serveroptions->format;
+		options->program = connection->program != NULL ? connection->program : connection->serveroptions->program;
+		updatederivedoptions(options);
+	}
+	else if (strcmp(line, "saturation") == 0)
+	{
+		double maxsaturation = atof(argument);
+
+		if (0. <= maxsaturation && maxsaturation <= 1.)
+		{
+			options->maxsaturation = maxsaturation;
+			updatederivedoptions(options);
+		}
+		else
+			fprintf(out, "error saturation needs to be in the range 0..1\n");
+	}
+	else if (strcmp(line, "path") == 0)
+	{
+		data->filepath = argument;
+		if (!processimage(data, options, out, stderr))
+			fprintf(out, "error could not read '%s'\n", argument);
+	}
+	else
+		fprintf(out, "error unknown request '%s'\n", line);
+
+	connection->length -= consumed;
+	memmove(connection->input, connection->input + consumed, connection->length);
+	connection->wanted = 0;
+	connection->lastrequest = monotonicseconds();
+	return REQUESTANSWERED;
+}
+
+static void queueready (struct Server* server, struct Connection* connection)
+{
+	connection->next = NULL;
+	if (server->readytail != NULL)
+		server->readytail->next = connection;
+	else
+		server->ready = connection;
+	server->readytail = connection;
+	pthread_cond_signal(&server->changed);
+}
+
+static void* serveworker (void* arg)
+{
+	struct Server* server = arg;
+	struct ImageData data;
+
+	memset(&data, 0, sizeof(data));
+
+	pthread_mutex_lock(&server->lock);
+	for (;;)
+	{
+		struct Connection* connection;
+		int state;
+
+		if (server->stopping)
+			break;
+		if (server->ready == NULL)
+		{
+			pthread_cond_wait(&server->changed, &server->lock);
+			continue;
+		}
+		connection = server->ready;
+		server->ready = connection->next;
+		if (server->ready == NULL)
+			server->readytail = NULL;
+		pthread_mutex_unlock(&server->lock);
+
+		// a single request, then the connection goes back: an idle client does not hold a worker
+		state = answerrequest(connection, &data);
+		if (state == REQUESTINCOMPLETE && connection->readable)
+			state = readinput(connection) ? answerrequest(connection, &data) : REQUESTCLOSE;
+		if (fflush(connection->out) != 0)
+			state = REQUESTCLOSE;
+
+		pthread_mutex_lock(&server->lock);
+		if (state == REQUESTCLOSE || server->stopping)
+			closeconnection(connection);
+		else if (state == REQUESTANSWERED)
+		{
+			// the input may hold the next request already, it waits behind the other clients
+			queueready(server, connection);
+		}
+		else
+		{
+			connection->next = server->returned;
+			server->returned = connection;
+			// when the pipe is full, the poller has wakeups to read already
+			while (write(server->wakefds[1], "", 1) < 0 && errno == EINTR)
+				;
+		}
+	}
+	pthread_mutex_unlock(&server->lock);
+	releaseimagedata(&data);
+	return NULL;
+}
+
+static int addwatched (struct Connection*** watched, size_t* nwatched, size_t* capacity, struct Connection* connection)
+{
+	if (*nwatched == *capacity)
+	{
+		size_t grown = *capacity == 0 ? 64 : *capacity * 2;
+		struct Connection** list = realloc(*watched, grown * sizeof(struct Connection*));
+
+		if (list == NULL)
+			return 0;
+		*watched = list;
+		*capacity = grown;
+	}
+	(*watched)[(*nwatched)++] = connection;
+	return 1;
+}
+
+// watches the listening socket and the idle connections, hands the ones with input to the workers
+static void pollconnections (struct Server* server)
+{
+	struct Connection** watched = NULL;
+	size_t nwatched = 0;
+	size_t capacity = 0;
+	struct pollfd* fds = NULL;
+	size_t nfds = 0;
+
+	for (;;)
+	{
+		size_t kept = 0;
+		int polled;
+		time_t now;
+
+		if (nfds < nwatched + 2)
+		{
+			nfds = capacity + 2;
+			fds = realloc(fds, nfds * sizeof(struct pollfd));
+		}
+		fds[0].fd = server->listenfd;
+		fds[1].fd = server->wakefds[0];
+		for (size_t i = 0; i < nwatched; ++i)
+			fds[i + 2].fd = watched[i]->fd;
+		for (size_t i = 0; i < nwatched + 2; ++i)
+		{
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+		}
+
+		// wakes up every second to close idle connections
+		polled = poll(fds, nwatched + 2, nwatched > 0 ? 1000 : -1);
+		if (stopsignalled)
+			break;
+		if (polled < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+
+		now = monotonicseconds();
+		pthread_mutex_lock(&server->lock);
+		for (size_t i = 0; i < nwatched; ++i)
+		{
+			struct Connection* connection = watched[i];
+
+			if (fds[i + 2].revents != 0)
+			{
+				connection->readable = 1;
+				queueready(server, connection);
+			}
+			else if (now - connection->lastrequest >= IDLESECONDS)
+				closeconnection(connection);
+			else
+				watched[kept++] = connection;
+		}
+		nwatched = kept;
+		if (fds[1].revents != 0)
+		{
+			char wakeups[64];
+
+			while (read(server->wakefds[0], wakeups, sizeof(wakeups)) == sizeof(wakeups))
+				;
+			while (server->returned != NULL)
+			{
+				struct Connection* connection = server->returned;
+
+				server->returned = connection->next;
+				if (!addwatched(&watched, &nwatched, &capacity, connection))
+					closeconnection(connection);
+			}
+		}
+		pthread_mutex_unlock(&server->lock);
+
+		if (fds[0].revents != 0)
+		{
+			int fd = accept(server->listenfd, NULL, NULL);
+
+			if (fd >= 0)
+			{
+				struct Connection* connection = openconnection(fd, server->options);
+
+				if (connection != NULL && !addwatched(&watched, &nwatched, &capacity, connection))
+					closeconnection(connection);
+			}
+			else if (errno != EINTR && errno != ECONNABORTED && errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				perror("accept");
+				break;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < nwatched; ++i)
+		closeconnection(watched[i]);
+	free(watched);
+	free(fds);
+}
+
+void runserver (const char* socketpath, const struct Options* options)
+{
+	struct Server server;
+	struct Options serveroptions = *options;
+	struct FormatProgram* defaultprogram = NULL;
+	struct sockaddr_un address;
+	struct stat st;
+	struct sigaction action;
+	int nworkers = options->jobs < 1 ? 1 : options->jobs;
+	pthread_t* workers;
+	int nstarted = 0;
+
+	if (strlen(socketpath) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "socket path '%s' is too long\n", socketpath);
+		return;
+	}
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path, socketpath);
+
+	// the stale socket of an earlier run is replaced, a live one or anything else at the path is left alone
+	if (lstat(socketpath, &st) == 0)
+	{
+		if (!S_ISSOCK(st.st_mode))
+		{
+			fprintf(stderr, "'%s' exists and is not a socket\n", socketpath);
+			return;
+		}
+		if (socketinuse(&address))
+		{
+			fprintf(stderr, "a server is already answering on '%s'\n", socketpath);
+			return;
+		}
+		unlink(socketpath);
+	}
+
+	memset(&server, 0, sizeof(server));
+	server.listenfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server.listenfd < 0
+		|| bind(server.listenfd, (struct sockaddr*)&address, sizeof(address)) != 0
+		|| listen(server.listenfd, LISTENBACKLOG) != 0)
+	{
+		perror(socketpath);
+		if (server.listenfd >= 0)
+			close(server.listenfd);
+		return;
+	}
+	if (pipe(server.wakefds) != 0)
+	{
+		perror("pipe");
+		close(server.listenfd);
+		unlink(socketpath);
+		return;
+	}
+	// a client that went away between poll and accept must not block the poller
+	fcntl(server.listenfd, F_SETFL, fcntl(server.listenfd, F_GETFL) | O_NONBLOCK);
+	fcntl(server.wakefds[0], F_SETFL, fcntl(server.wakefds[0], F_GETFL) | O_NONBLOCK);
+	fcntl(server.wakefds[1], F_SETFL, fcntl(server.wakefds[1], F_GETFL) | O_NONBLOCK);
+	pthread_mutex_init(&server.lock, NULL);
+	pthread_cond_init(&server.changed, NULL);
+
+	// every path and blob gets its colors back, the text mode has no default format of its own
+	if (serveroptions.format == NULL && serveroptions.output == OUTPUTTEXT)
+	{
+		defaultprogram = compileFormat(DEFAULTFORMAT, OUTPUTTEXT);
+		serveroptions.format = DEFAULTFORMAT;
+		serveroptions.program = defaultprogram;
+	}
+	server.options = &serveroptions;
+
+	// a client going away must not take the server down with it
+	signal(SIGPIPE, SIG_IGN);
+	// interrupting or terminating the server leaves the poll loop, the socket is removed on the way out
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = &stopserver;
+	sigemptyset(&action.sa_mask);
+	stopwakefd = server.wakefds[1];
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	// the main thread polls, the workers answer
+	workers = calloc(nworkers, sizeof(pthread_t));
+	for (int i = 0; i < nworkers; ++i)
+		if (pthread_create(&workers[nstarted], NULL, &serveworker, &server) == 0)
+			++nstarted;
+	if (nstarted > 0)
+		pollconnections(&server);
+	else
+		fprintf(stderr, "could not start a worker thread\n");
+
+	pthread_mutex_lock(&server.lock);
+	server.stopping = 1;
+	pthread_cond_broadcast(&server.changed);
+	pthread_mutex_unlock(&server.lock);
+	for (int i = 0; i < nstarted; ++i)
+		pthread_join(workers[i], NULL);
+	free(workers);
+
+	while (server.ready != NULL)
+	{
+		struct Connection* connection = server.ready;
+
+		server.ready = connection->next;
+		closeconnection(connection);
+	}
+	while (server.returned != NULL)
+	{
+		struct Connection* connection = server.returned;
+
+		server.returned = connection->next;
+		closeconnection(connection);
+	}
+	pthread_cond_destroy(&server.changed);
+	pthread_mutex_destroy(&server.lock);
+	close(server.wakefds[0]);
+	close(server.wakefds[1]);
+	close(server.listenfd);
+	unlink(socketpath);
+	freeFormat(defaultprogram);
+}
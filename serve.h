@@ -0,0 +1,16 @@
+#pragma once
+#include "options.h"
+
+// serves requests on a unix socket with options->jobs workers, each owning its ImageData.
+// the main thread watches the connections and queues those with input for the workers, a worker
+// answers one request and hands the connection back, so idle clients do not hold workers.
+// a connection without a request for a minute is closed. SIGINT and SIGTERM stop the server and remove its socket.
+// a connection sends any number of requests, one line each:
+//   format <formatstr>      sets the output format for the following images, an empty one the server's
+//   saturation <maxsat>     sets the saturation limit for the following images
+//   path <filepath>         analyses the image at filepath
+//   blob <length>           analyses the length bytes of image data that follow the line
+// each path or blob is answered with the result line of the format or --output mode, or with "error <message>".
+// without -F or a format request the text mode answers "background <color> primary <color> secondary <color> detail <color>".
+// format and saturation are only answered when they fail
+void runserver (const char* socketpath, const struct Options* options);
@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "stats.h"
+#include "format.h"
+
+static const char* stageNames[STATSSTAGECOUNT] =
+{
+	"decode",
+	"scale",
+	"pixels",
+	"histogram",
+	"edgecolor",
+	"textcolors",
+	"total",
+};
+
+struct StatsSummary
+{
+	pthread_mutex_t lock;
+	long long start;
+
+	// per image stage timings, sorted when the summary is printed
+	long long* samples[STATSSTAGECOUNT];
+	size_t count;
+	size_t capacity;
+
+	size_t cached;
+	size_t decodedpixels;
+	size_t analysedpixels;
+	size_t distinctcolors;
+	size_t candidates;
+	size_t bytesused;
+};
+
+struct StatsSummary* createStatsSummary ()
+{
+	struct StatsSummary* summary = calloc(1, sizeof(struct StatsSummary));
+
+	pthread_mutex_init(&summary->lock, NULL);
+	summary->start = statsnow();
+	return summary;
+}
+
+void freeStatsSummary (struct StatsSummary* summary)
+{
+	for (int stage = 0; stage < STATSSTAGECOUNT; ++stage)
+		free(summary->samples[stage]);
+	pthread_mutex_destroy(&summary->lock);
+	free(summary);
+}
+
+void addToStatsSummary (struct StatsSummary* summary, const struct ImageStats* stats)
+{
+	pthread_mutex_lock(&summary->lock);
+	if (summary->count == summary->capacity)
+	{
+		summary->capacity = summary->capacity == 0 ? 256 : summary->capacity * 2;
+		for (int stage = 0; stage < STATSSTAGECOUNT; ++stage)
+			summary->samples[stage] = realloc(summary->samples[stage], summary->capacity * sizeof(long long));
+	}
+	for (int stage = 0; stage < STATSSTAGECOUNT; ++stage)
+		summary->samples[stage][summary->count] = stats->stagens[stage];
+	++summary->count;
+
+	summary->cached += stats->cached;
+	summary->decodedpixels += stats->decodedwidth * stats->decodedheight;
+	summary->analysedpixels += stats->width * stats->height;
+	summary->distinctcolors += stats->distinctcolors;
+	summary->candidates += stats->candidates;
+	summary->bytesused += stats->bytesused;
+	pthread_mutex_unlock(&summary->lock);
+}
+
+static void fprintJSONString (FILE* fd, const char* str)
+{
+	fputc('"', fd);
+	for (; *str != 0; ++str)
+	{
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\')
+			fprintf(fd, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(fd, "\\u%04x", c);
+		else
+		{
+			size_t length = utf8SequenceLength(str);
+
+			// file names are bytes, the ones that are not UTF-8 are replaced
+			if (length == 0)
+				fputs("\\ufffd", fd);
+			else
+			{
+				fwrite(str, 1, length, fd);
+				str += length - 1;
+			}
+		}
+	}
+	fputc('"', fd);
+}
+
+static double milliseconds (long long ns)
+{
+	return (double)ns / 1e6;
+}
+
+void printImageStats (FILE* fd, const char* filepath, const struct ImageStats* stats, int json)
+{
+	if (json)
+	{
+		fprintf(fd, "{\"file\": ");
+		fprintJSONString(fd, filepath);
+		for (int stage = 0; stage < STATSSTAGECOUNT; ++stage)
+			fprintf(fd, ", \"%s_ms\": %.3f", stageNames[stage], milliseconds(stats->stagens[stage]));
+		fprintf(fd, ", \"cached\": %s, \"decoded_width\": %zu, \"decoded_height\": %zu, \"width\": %zu, \"height\": %zu"
+				", \"distinct_colors\": %zu, \"edge_shifts\": %zu, \"candidates\": %zu, \"bytes_used\": %zu}\n",
+				stats->cached ? "true" : "false", stats->decodedwidth, stats->decodedheight, stats->width, stats->height,
+				stats->distinctcolors, stats->edgeshifts, stats->candidates, stats->bytesused);
+		return;
+	}
+
+	fprintf(fd, "stats '%s':", filepath);
+	if (stats->cached)
+		fprintf(fd, " cached");
+	for (int stage = 0; stage < STATSSTAGECOUNT; ++stage)
+		fprintf(fd, " %s %.3fms", stageNames[stage], milliseconds(stats->stagens[stage]));
+	fprintf(fd, "\n\t%zux%zu decoded, %zux%zu analysed, %zu colors, %zu edge shifts, %zu candidates, %zu bytes used\n",
+			stats->decodedwidth, stats->decodedheight, stats->width, stats->height,
+			stats->distinctcolors, stats->edgeshifts, stats->candidates, stats->bytesused);
+}
+
+static int nscomp (const void* left, const void* right)
+{
+	long long l = *(const long long*)left;
+	long long r = *(const long long*)right;
+
+	return (l > r) - (l < r);
+}
+
+static long long percentile (const long long* sorted, size_t count, int percent)
+{
+	// nearest rank
+	size_t rank = (count * percent + 99) / 100;
+
+	return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+void printStatsSummary (FILE* fd, struct StatsSummary* summary, int json)
+{
+	static const int percents[] = { 50, 90, 99, 100 };
+	long long elapsed = statsnow() - summary->start;
+
+	pthread_mutex_lock(&summary->lock);
+	if (json)
+		fprintf(fd, "{\"summary\": true, \"images\": %zu, \"cached\": %zu, \"wall_ms\": %.3f, \"decoded_pixels\": %zu, \"analysed_pixels\": %zu"
+				", \"distinct_colors\": %zu, \"candidates\": %zu, \"bytes_used\": %zu",
+				summary->count, summary->cached, milliseconds(elapsed), summary->decodedpixels, summary->analysedpixels,
+				summary->distinctcolors, summary->candidates, summary->bytesused);
+	else
+		fprintf(fd, "stats summary: %zu images, %zu cached, %.3fms wall, %zu pixels decoded, %zu analysed, %zu colors, %zu candidates, %zu bytes used\n",
+				summary->count, summary->cached, milliseconds(elapsed), summary->decodedpixels, summary->analysedpixels,
+				summary->distinctcolors, summary->candidates, summary->bytesused);
+
+	for (int stage = 0; stage < STATSSTAGECOUNT && summary->count > 0; ++stage)
+	{
+		long long* sorted = summary->samples[stage];
+		long long sum = 0;
+
+		qsort(sorted, summary->count, sizeof(long long), &nscomp);
+		for (size_t i = 0; i < summary->count; ++i)
+			sum += sorted[i];
+
+		if (json)
+		{
+			fprintf(fd, ", \"%s\": {\"sum_ms\": %.3f", stageNames[stage], milliseconds(sum));
+			for (int p = 0; p < sizeof(percents) / sizeof(percents[0]); ++p)
+				fprintf(fd, ", \"p%d_ms\": %.3f", percents[p], milliseconds(percentile(sorted, summary->count, percents[p])));
+			fprintf(fd, "}");
+		}
+		else
+		{
+			fprintf(fd, "\t%-10s sum %.3fms", stageNames[stage], milliseconds(sum));
+			for (int p = 0; p < sizeof(percents) / sizeof(percents[0]); ++p)
+				fprintf(fd, " p%d %.3fms", percents[p], milliseconds(percentile(sorted, summary->count, percents[p])));
+			fprintf(fd, "\n");
+		}
+	}
+	if (json)
+		fprintf(fd, "}\n");
+	pthread_mutex_unlock(&summary->lock);
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include <stdio.h>
+#include <stddef.h>
+#include <time.h>
+
+enum StatsStage
+{
+	STATSDECODE,
+	STATSSCALE,
+	STATSPIXELS,
+	STATSHISTOGRAM,
+	STATSEDGECOLOR,
+	STATSTEXTCOLORS,
+	STATSTOTAL,
+	STATSSTAGECOUNT,
+};
+
+// timings and counters of one image, collected when ImageData.stats is set
+struct ImageStats
+{
+	long long stagens[STATSSTAGECOUNT];
+	size_t decodedwidth;
+	size_t decodedheight;
+	size_t width;
+	size_t height;
+	size_t distinctcolors;
+	size_t edgeshifts; // transparent columns skipped to find the edge column
+	size_t candidates; // colours considered for text colours
+	size_t bytesused; // size of the pixel, histogram and colour set buffers, not the capacity the workspace keeps
+	int cached;
+};
+
+static inline long long statsnow ()
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (long long)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// a single test of the pointer when stats are off
+#define STATSSTART(stats) ((stats) != NULL ? statsnow() : 0)
+#define STATSSTOP(stats, stage, start) do { if ((stats) != NULL) (stats)->stagens[stage] += statsnow() - (start); } while (0)
+
+struct StatsSummary;
+
+struct StatsSummary* createStatsSummary ();
+void freeStatsSummary (struct StatsSummary* summary);
+void addToStatsSummary (struct StatsSummary* summary, const struct ImageStats* stats);
+
+void printImageStats (FILE* fd, const char* filepath, const struct ImageStats* stats, int json);
+void printStatsSummary (FILE* fd, struct StatsSummary* summary, int json);
@@ -0,0 +1,78 @@
+#include <stdlib.h>
+#include <string.h>
+#include "workspace.h"
+#include "histogram.h"
+
+struct Workspace* createWorkspace ()
+{
+	struct Workspace* workspace = calloc(1, sizeof(struct Workspace));
+
+	workspace->histogram = createHistogram();
+	workspace->edgeHistogram = createHistogram();
+	return workspace;
+}
+
+void freeWorkspace (struct Workspace* workspace)
+{
+	free(workspace->pixels);
+	free(workspace->edgeColumn);
+	free(workspace->scratch);
+	freeHistogram(workspace->histogram);
+	for (int i = 0; i < workspace->bandHistogramCount; ++i)
+		freeHistogram(workspace->bandHistograms[i]);
+	free(workspace->bandHistograms);
+	freeHistogram(workspace->edgeHistogram);
+	free(workspace->edgeCandidates);
+	free(workspace);
+}
+
+void* reserveBuffer (void** buffer, size_t* capacity, size_t size)
+{
+	if (size > *capacity)
+	{
+		// nothing to keep, no copy
+		free(*buffer);
+		*buffer = malloc(size);
+		*capacity = *buffer != NULL ? size : 0;
+	}
+	return *buffer;
+}
+
+uint32_t* workspacePixels (struct Workspace* workspace, size_t count)
+{
+	return reserveBuffer((void**)&workspace->pixels, &workspace->pixelcapacity, count * sizeof(uint32_t));
+}
+
+uint32_t* workspaceEdgeColumn (struct Workspace* workspace, size_t count)
+{
+	uint32_t* edgeColumn = reserveBuffer((void**)&workspace->edgeColumn, &workspace->edgecapacity, count * sizeof(uint32_t));
+
+	if (edgeColumn != NULL)
+		memset(edgeColumn, 0, count * sizeof(uint32_t));
+	return edgeColumn;
+}
+
+void* workspaceScratch (struct Workspace* workspace, size_t size)
+{
+	return reserveBuffer(&workspace->scratch, &workspace->scratchcapacity, size);
+}
+
+struct Histogram* workspaceHistogram (struct Workspace* workspace, int quantBits)
+{
+	clearHistogram(workspace->histogram);
+	setHistogramQuantBits(workspace->histogram, quantBits);
+	return workspace->histogram;
+}
+
+struct Histogram* workspaceBandHistogram (struct Workspace* workspace, int band, int quantBits)
+{
+	if (band >= workspace->bandHistogramCount)
+	{
+		workspace->bandHistograms = realloc(workspace->bandHistograms, (band + 1) * sizeof(struct Histogram*));
+		while (workspace->bandHistogramCount <= band)
+			workspace->bandHistograms[workspace->bandHistogramCount++] = createHistogram();
+	}
+	clearHistogram(workspace->bandHistograms[band]);
+	setHistogramQuantBits(workspace->bandHistograms[band], quantBits);
+	return workspace->bandHistograms[band];
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+struct Histogram;
+
+// storage a worker keeps across images: buffers grow to the largest image seen and are handed out
+// again for the next one, so analysing images of a steady size does not allocate
+struct Workspace
+{
+	uint32_t* pixels;
+	size_t pixelcapacity;
+	uint32_t* edgeColumn;
+	size_t edgecapacity;
+	void* scratch; // for the length of one stage: bands, rows, text color candidates
+	size_t scratchcapacity;
+
+	struct Histogram* histogram;
+	struct Histogram** bandHistograms; // see analyseimageThreaded
+	int bandHistogramCount;
+	struct Histogram* edgeHistogram; // see findEdgeColor
+	void* edgeCandidates;
+	size_t edgecandidatecapacity;
+};
+
+struct Workspace* createWorkspace ();
+void freeWorkspace (struct Workspace* workspace);
+
+// at least size bytes, the contents are lost when it grows
+void* reserveBuffer (void** buffer, size_t* capacity, size_t size);
+
+uint32_t* workspacePixels (struct Workspace* workspace, size_t count);
+uint32_t* workspaceEdgeColumn (struct Workspace* workspace, size_t count); // zeroed
+void* workspaceScratch (struct Workspace* workspace, size_t size);
+struct Histogram* workspaceHistogram (struct Workspace* workspace, int quantBits); // empty
+struct Histogram* workspaceBandHistogram (struct Workspace* workspace, int band, int quantBits); // empty